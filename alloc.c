@@ -0,0 +1,150 @@
+/* See Copyright Notice in LICENSE.txt */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "misc.h"
+#include "alloc.h"
+
+/* Per node allocator for lua states. Small blocks (most strings,
+ * tables and closures) are served from per size class free lists
+ * that are refilled from 16k slabs. Slabs are only released once
+ * the node is destroyed. Larger blocks use malloc directly.
+ *
+ * Each node is only ever run by one thread at a time, so no locking
+ * is needed. */
+
+#define SLAB_SIZE 16384
+#define SLAB_HEADER 16 // keeps blocks 16 byte aligned
+#define SMALL_MAX 256
+
+static const size_t class_size[ALLOC_CLASSES] = {
+    16, 32, 48, 64, 96, 128, 192, 256
+};
+
+// size class by (size + 15) / 16
+static const unsigned char class_by_size[SMALL_MAX / 16 + 1] = {
+    0, 0, 1, 2, 3, 4, 4, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7
+};
+
+typedef struct block_s {
+    struct block_s *next;
+} block_t;
+
+typedef struct slab_s {
+    struct slab_s *next;
+} slab_t;
+
+static int size_class(size_t size) {
+    return class_by_size[(size + 15) / 16];
+}
+
+static int refill(alloc_t *a, int class) {
+    slab_t *slab = malloc(SLAB_SIZE);
+    if (!slab)
+        return 0;
+    slab->next = a->slabs;
+    a->slabs = slab;
+    a->reserved += SLAB_SIZE;
+
+    size_t size = class_size[class];
+    char *pos = (char*)slab + SLAB_HEADER;
+    char *end = (char*)slab + SLAB_SIZE;
+    while (pos + size <= end) {
+        block_t *block = (block_t*)pos;
+        block->next = a->free_list[class];
+        a->free_list[class] = block;
+        pos += size;
+    }
+    return 1;
+}
+
+static void *alloc_block(alloc_t *a, size_t size) {
+    if (size > SMALL_MAX) {
+        void *ptr = malloc(size);
+        if (ptr)
+            a->reserved += size;
+        return ptr;
+    }
+    int class = size_class(size);
+    if (!a->free_list[class] && !refill(a, class))
+        return NULL;
+    block_t *block = a->free_list[class];
+    a->free_list[class] = block->next;
+    return block;
+}
+
+static void free_block(alloc_t *a, void *ptr, size_t size) {
+    if (size > SMALL_MAX) {
+        free(ptr);
+        a->reserved -= size;
+        return;
+    }
+    int class = size_class(size);
+    block_t *block = ptr;
+    block->next = a->free_list[class];
+    a->free_list[class] = block;
+}
+
+void alloc_init(alloc_t *a, size_t limit) {
+    memset(a, 0, sizeof(alloc_t));
+    a->limit = limit;
+}
+
+void *alloc_lua(alloc_t *a, void *ptr, size_t osize, size_t nsize) {
+    if (!ptr)
+        osize = 0;
+
+    if (nsize == 0) {
+        if (ptr) {
+            free_block(a, ptr, osize);
+            a->used -= osize;
+        }
+        return NULL;
+    }
+
+    // Lua raises a memory error if this fails. Shrinking always works.
+    if (nsize > osize && a->enforce && a->limit &&
+            a->used + nsize - osize > a->limit) {
+        a->num_failed++;
+        return NULL;
+    }
+
+    void *block;
+    if (!ptr) {
+        block = alloc_block(a, nsize);
+    } else if (osize <= SMALL_MAX && nsize <= SMALL_MAX &&
+            size_class(osize) == size_class(nsize)) {
+        block = ptr;
+    } else if (osize > SMALL_MAX && nsize > SMALL_MAX) {
+        block = realloc(ptr, nsize);
+        if (block)
+            a->reserved += nsize - osize;
+    } else {
+        block = alloc_block(a, nsize);
+        if (block) {
+            memcpy(block, ptr, osize < nsize ? osize : nsize);
+            free_block(a, ptr, osize);
+        }
+    }
+    if (!block)
+        return NULL;
+
+    a->used += nsize - osize;
+    if (a->used > a->peak)
+        a->peak = a->used;
+    return block;
+}
+
+void alloc_destroy(alloc_t *a) {
+    slab_t *slab = a->slabs;
+    while (slab) {
+        slab_t *next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    a->slabs = NULL;
+    memset(a->free_list, 0, sizeof(a->free_list));
+    a->reserved = 0;
+}
@@ -0,0 +1,25 @@
+/* See Copyright Notice in LICENSE.txt */
+
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <stddef.h>
+
+#define ALLOC_CLASSES 8
+
+typedef struct {
+    void *free_list[ALLOC_CLASSES]; // free blocks per size class
+    void *slabs;       // slabs used for small blocks
+    size_t used;       // bytes currently allocated by lua
+    size_t peak;       // maximum of used
+    size_t reserved;   // bytes requested from the system
+    size_t limit;      // maximum of used (0: unlimited)
+    int enforce;       // limit is only enforced while > 0
+    int num_failed;    // allocations refused because of the limit
+} alloc_t;
+
+void alloc_init(alloc_t *a, size_t limit);
+void *alloc_lua(alloc_t *a, void *ptr, size_t osize, size_t nsize);
+void alloc_destroy(alloc_t *a);
+
+#endif
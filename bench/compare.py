@@ -0,0 +1,72 @@
+#!/usr/bin/env python3
+#
+# See Copyright Notice in LICENSE.txt
+#
+# Compares two reports written by run.py. Exits with status 1
+# if any metric got worse by more than the given threshold.
+
+import argparse
+import json
+import sys
+
+# metric path, minimal absolute change worth reporting
+METRICS = [
+    ("frame_time_ms.p50", 0.05),
+    ("frame_time_ms.p90", 0.05),
+    ("frame_time_ms.p99", 0.1),
+    ("lua_cpu_ms.per_frame", 0.02),
+    ("lua_allocs.per_frame", 1),
+    ("texture_bytes.peak", 4096),
+    ("lua_memory_bytes.peak", 65536),
+]
+
+
+def lookup(stats, path):
+    for key in path.split("."):
+        stats = stats.get(key) if isinstance(stats, dict) else None
+    return stats
+
+
+def main():
+    parser = argparse.ArgumentParser(description="compare benchmark reports")
+    parser.add_argument("baseline")
+    parser.add_argument("current")
+    parser.add_argument("--threshold", type=float, default=15,
+                        help="allowed regression in percent (default 15)")
+    args = parser.parse_args()
+
+    with open(args.baseline) as f:
+        baseline = json.load(f)["results"]
+    with open(args.current) as f:
+        current = json.load(f)["results"]
+
+    regressions = 0
+    print("%-10s %-22s %12s %12s %8s" % ("benchmark", "metric", "baseline", "current", "change"))
+    for name in sorted(set(baseline) | set(current)):
+        if name not in baseline or name not in current:
+            print("%-10s missing in %s" % (name, "baseline" if name not in baseline else "current"))
+            continue
+        for metric, min_delta in METRICS:
+            old = lookup(baseline[name], metric)
+            new = lookup(current[name], metric)
+            if old is None or new is None:
+                continue
+            delta = new - old
+            change = delta * 100.0 / old if old else 0.0
+            marker = ""
+            if abs(delta) >= min_delta and change > args.threshold:
+                marker = "  REGRESSION"
+                regressions += 1
+            elif abs(delta) >= min_delta and change < -args.threshold:
+                marker = "  improved"
+            print("%-10s %-22s %12.3f %12.3f %+7.1f%%%s" % (
+                name, metric, old, new, change, marker))
+
+    if regressions:
+        print("\n%d regression(s) above %.0f%%" % (regressions, args.threshold))
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
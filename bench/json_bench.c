@@ -0,0 +1,118 @@
+/* See Copyright Notice in LICENSE.txt */
+
+/* Compares the native json module with the bundled module_json.lua
+ * on generated multi megabyte documents.
+ *
+ * Usage: bench/json_bench [size_in_mb ...]  (default: 0.25 1)
+ *
+ * module_json.lua decodes in quadratic time, so expect the Lua
+ * side to take minutes for documents larger than a few megabytes. */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include "json.h"
+#include "module_json.h"
+
+static const char bench[] =
+    "local lua_json, sizes = ...\n"
+    "\n"
+    "local function make_document(target_size)\n"
+    "    local items, size = {}, 0\n"
+    "    while size < target_size do\n"
+    "        local i = #items + 1\n"
+    "        items[i] = {\n"
+    "            id = i,\n"
+    "            title = 'Departure ' .. i .. ' to \"Central Station\"',\n"
+    "            platform = i % 12 + 1,\n"
+    "            delay = (i % 7) * 0.25,\n"
+    "            cancelled = i % 13 == 0,\n"
+    "            stops = {'Stop A', 'Stop B', 'Stop C ' .. i},\n"
+    "            position = {lat = 52.52 + i * 1e-5, lon = 13.4 - i * 1e-5},\n"
+    "            note = 'Line ' .. i .. '\\nnow with umlauts: \\195\\164\\195\\182',\n"
+    "        }\n"
+    "        size = size + #json.encode(items[i]) + 1\n"
+    "    end\n"
+    "    return json.encode({generated = 1420070400, items = items})\n"
+    "end\n"
+    "\n"
+    "local function measure(fn, arg)\n"
+    "    collectgarbage()\n"
+    "    local runs, start = 0, os.clock()\n"
+    "    repeat\n"
+    "        fn(arg)\n"
+    "        runs = runs + 1\n"
+    "    until os.clock() - start >= 1\n"
+    "    return (os.clock() - start) / runs * 1000\n"
+    "end\n"
+    "\n"
+    "print(string.format('%6s  %10s %10s %7s  %10s %10s %7s',\n"
+    "    'size', 'decode', 'lua', '', 'encode', 'lua', ''))\n"
+    "for _, mb in ipairs(sizes) do\n"
+    "    local doc = make_document(mb * 1024 * 1024)\n"
+    "    local data = json.decode(doc)\n"
+    "    assert(#lua_json.decode(doc).items == #data.items)\n"
+    "    local native_decode = measure(json.decode, doc)\n"
+    "    local lua_decode = measure(lua_json.decode, doc)\n"
+    "    local native_encode = measure(json.encode, data)\n"
+    "    local lua_encode = measure(lua_json.encode, data)\n"
+    "    print(string.format('%5.2fMB %8.1fms %8.1fms %6.1fx  %8.1fms %8.1fms %6.1fx',\n"
+    "        #doc / 1024 / 1024,\n"
+    "        native_decode, lua_decode, lua_decode / native_decode,\n"
+    "        native_encode, lua_encode, lua_encode / native_encode\n"
+    "    ))\n"
+    "end\n";
+
+int main(int argc, char *argv[]) {
+    lua_State *L = luaL_newstate();
+    luaL_openlibs(L);
+
+    // module_json.lua registers itself as 'json' using module().
+    // Grab it and remove it again before loading the native version.
+    if (luaL_loadbuffer(L, module_json, module_json_size, "=module_json.lua") ||
+            lua_pcall(L, 0, 0, 0)) {
+        fprintf(stderr, "cannot load module_json.lua: %s\n", lua_tostring(L, -1));
+        return 1;
+    }
+    lua_getglobal(L, "json");
+    lua_pushnil(L);
+    lua_setglobal(L, "json");
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "loaded");
+    lua_pushnil(L);
+    lua_setfield(L, -2, "json");
+    lua_pop(L, 2);
+
+    luaopen_json(L);
+    lua_pop(L, 1);
+
+    if (luaL_loadbuffer(L, bench, sizeof(bench) - 1, "=json_bench")) {
+        fprintf(stderr, "cannot load benchmark: %s\n", lua_tostring(L, -1));
+        return 1;
+    }
+    lua_insert(L, -2);              // bench lua_json
+
+    lua_newtable(L);                // bench lua_json sizes
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++) {
+            lua_pushnumber(L, atof(argv[i]));
+            lua_rawseti(L, -2, i);
+        }
+    } else {
+        lua_pushnumber(L, 0.25);
+        lua_rawseti(L, -2, 1);
+        lua_pushnumber(L, 1);
+        lua_rawseti(L, -2, 2);
+    }
+
+    if (lua_pcall(L, 2, 0, 0)) {
+        fprintf(stderr, "benchmark failed: %s\n", lua_tostring(L, -1));
+        return 1;
+    }
+    lua_close(L);
+    return 0;
+}
@@ -0,0 +1,13 @@
+gl.setup(320, 240)
+
+local white = resource.create_colored_texture(1, 1, 1, 1)
+
+function node.render()
+    gl.clear(0.1, 0.1, 0.3, 1)
+    for i = 1, 50 do
+        local t = sys.now() + i * 0.1
+        local x = 160 + math.sin(t) * 120
+        local y = 120 + math.cos(t * 1.3) * 90
+        white:draw(x - 4, y - 4, x + 4, y + 4, 0.5)
+    end
+end
@@ -0,0 +1,21 @@
+gl.setup(1024, 768)
+
+-- run.py adds 20 copies of the 'child' node to this node.
+local COLS, ROWS = 5, 4
+
+local children = {}
+
+node.event("child_add", function(name)
+    children[#children+1] = name
+    table.sort(children)
+end)
+
+function node.render()
+    gl.clear(0, 0, 0, 1)
+    local w, h = WIDTH / COLS, HEIGHT / ROWS
+    for idx, name in ipairs(children) do
+        local col = (idx - 1) % COLS
+        local row = math.floor((idx - 1) / COLS)
+        resource.render_child(name):draw(col * w, row * h, col * w + w, row * h + h)
+    end
+end
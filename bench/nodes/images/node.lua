@@ -0,0 +1,16 @@
+gl.setup(1024, 768)
+
+local images = {}
+for i = 1, 64 do
+    images[i] = resource.load_image(i % 2 == 0 and "beamer.png" or "blue_macaw.png")
+end
+
+function node.render()
+    gl.clear(0, 0, 0, 1)
+    for i, image in ipairs(images) do
+        local col = (i - 1) % 8
+        local row = math.floor((i - 1) / 8)
+        local offset = math.sin(sys.now() + i) * 8
+        image:draw(col * 128 + offset, row * 96, col * 128 + 128 + offset, row * 96 + 96)
+    end
+end
@@ -0,0 +1,12 @@
+gl.setup(320, 240)
+
+-- sync_test.py compares the reported clocks of both instances
+local frame = 0
+
+function node.render()
+    gl.clear(0, 0, 0, 1)
+    frame = frame + 1
+    if frame % 10 == 0 then
+        print(string.format("clock %.6f", sys.now()))
+    end
+end
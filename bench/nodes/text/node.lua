@@ -0,0 +1,14 @@
+gl.setup(1024, 768)
+
+local font = resource.load_font("silkscreen.ttf")
+
+function node.render()
+    gl.clear(0, 0, 0, 1)
+    for line = 0, 47 do
+        local x = -((sys.now() * 100 + line * 37) % 200)
+        font:write(x, line * 16, string.format(
+            "line %02d - time %.3f - the quick brown fox jumps over the lazy dog",
+            line, sys.now()
+        ), 14, 1, 1, 1, 1)
+    end
+end
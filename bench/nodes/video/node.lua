@@ -0,0 +1,9 @@
+gl.setup(1024, 768)
+
+-- video.mp4 is generated by run.py
+local video = util.videoplayer("video.mp4")
+
+function node.render()
+    gl.clear(0, 0, 0, 1)
+    video:draw(0, 0, WIDTH, HEIGHT)
+end
@@ -0,0 +1,153 @@
+#!/usr/bin/env python3
+#
+# See Copyright Notice in LICENSE.txt
+#
+# Runs info-beamer in headless mode over the samples and a set
+# of synthetic stress trees and collects the statistics written
+# by INFOBEAMER_STATS into a single json report.
+
+import argparse
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+BASE = os.path.dirname(os.path.abspath(__file__))
+REPO = os.path.dirname(BASE)
+
+
+class Skip(Exception):
+    pass
+
+
+def sample(name):
+    def setup(target):
+        shutil.copytree(os.path.join(REPO, "samples", name), target)
+    return setup
+
+
+def synthetic(name, resources=(), children=0):
+    def setup(target):
+        shutil.copytree(os.path.join(BASE, "nodes", name), target)
+        for resource in resources:
+            shutil.copy(os.path.join(REPO, resource), target)
+        for idx in range(children):
+            shutil.copytree(
+                os.path.join(BASE, "nodes", "child"),
+                os.path.join(target, "child-%02d" % idx)
+            )
+    return setup
+
+
+def video(target):
+    if not shutil.which("ffmpeg"):
+        raise Skip("ffmpeg not found")
+    synthetic("video")(target)
+    subprocess.check_call([
+        "ffmpeg", "-loglevel", "error",
+        "-f", "lavfi", "-i", "testsrc=duration=10:size=1280x720:rate=30",
+        "-pix_fmt", "yuv420p", os.path.join(target, "video.mp4"),
+    ])
+
+
+SUITE = [
+    ("hello", sample("hello")),
+    ("image", sample("image")),
+    ("parrot", sample("parrot")),
+    ("shader", sample("shader")),
+    ("green", sample("green")),
+    ("children", synthetic("children", children=20)),
+    ("text", synthetic("text", resources=["samples/hello/silkscreen.ttf"])),
+    ("images", synthetic("images", resources=[
+        "samples/image/beamer.png",
+        "samples/parrot/blue_macaw.png",
+    ])),
+    ("video", video),
+]
+
+
+def run(args, name, setup, workdir):
+    tree = os.path.join(workdir, name)
+    setup(tree)
+
+    stats = os.path.join(workdir, name + ".json")
+    env = dict(os.environ)
+    env.update({
+        "INFOBEAMER_HEADLESS": "1",
+        "INFOBEAMER_FRAMES": str(args.frames),
+        "INFOBEAMER_STATS": stats,
+        "INFOBEAMER_ADDR": "127.0.0.1",
+        "INFOBEAMER_PORT": str(args.port),
+        "INFOBEAMER_WIDTH": str(args.width),
+        "INFOBEAMER_HEIGHT": str(args.height),
+    })
+    with open(os.path.join(workdir, name + ".log"), "w") as log:
+        ret = subprocess.call(
+            [os.path.abspath(args.binary), tree],
+            env=env, stdout=log, stderr=subprocess.STDOUT,
+        )
+    if ret != 0 or not os.path.exists(stats):
+        raise RuntimeError("%s failed (exit code %d). see %s.log" % (name, ret, name))
+    with open(stats) as f:
+        return json.load(f)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="info-beamer render benchmark")
+    parser.add_argument("--binary", default=os.path.join(REPO, "info-beamer"))
+    parser.add_argument("--frames", type=int, default=300)
+    parser.add_argument("--width", type=int, default=1024)
+    parser.add_argument("--height", type=int, default=768)
+    parser.add_argument("--port", type=int, default=14444)
+    parser.add_argument("--output", default="-")
+    parser.add_argument("--keep", action="store_true",
+                        help="keep the temporary directory with logs")
+    parser.add_argument("only", nargs="*", help="only run these benchmarks")
+    args = parser.parse_args()
+
+    workdir = tempfile.mkdtemp(prefix="info-beamer-bench-")
+    results = {}
+    failed = False
+    try:
+        for name, setup in SUITE:
+            if args.only and name not in args.only:
+                continue
+            sys.stderr.write("%-10s " % name)
+            sys.stderr.flush()
+            try:
+                results[name] = stats = run(args, name, setup, workdir)
+                sys.stderr.write("p50 %7.3fms p99 %7.3fms lua %7.3fms/frame\n" % (
+                    stats["frame_time_ms"]["p50"],
+                    stats["frame_time_ms"]["p99"],
+                    stats["lua_cpu_ms"]["per_frame"],
+                ))
+            except Skip as err:
+                sys.stderr.write("skipped: %s\n" % err)
+            except Exception as err:
+                sys.stderr.write("failed: %s\n" % err)
+                failed = True
+    finally:
+        if args.keep or failed:
+            sys.stderr.write("logs are in %s\n" % workdir)
+        else:
+            shutil.rmtree(workdir)
+
+    report = json.dumps({
+        "frames": args.frames,
+        "width": args.width,
+        "height": args.height,
+        "results": results,
+    }, indent=2, sort_keys=True)
+
+    if args.output == "-":
+        print(report)
+    else:
+        with open(args.output, "w") as f:
+            f.write(report + "\n")
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
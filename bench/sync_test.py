@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+#
+# See Copyright Notice in LICENSE.txt
+#
+# Runs a leader and a follower instance (INFOBEAMER_SYNC) on the
+# loopback interface and checks that the follower clock ends up
+# within the given tolerance of the leader clock.
+
+import argparse
+import os
+import re
+import statistics
+import subprocess
+import sys
+import threading
+import time
+
+BASE = os.path.dirname(os.path.abspath(__file__))
+REPO = os.path.dirname(BASE)
+
+CLOCK = re.compile(r"clock ([0-9.]+)")
+
+
+class Instance(object):
+    def __init__(self, args, name, port, sync):
+        env = dict(os.environ)
+        env.update({
+            "INFOBEAMER_HEADLESS": "1",
+            "INFOBEAMER_CLOCK": "paced",
+            "INFOBEAMER_REFRESH": "60",
+            "INFOBEAMER_ADDR": "127.0.0.1",
+            "INFOBEAMER_PORT": str(port),
+            "INFOBEAMER_SYNC": sync,
+        })
+        self.name = name
+        self.log = []
+        self.offsets = []   # (receive time, sys.now() - receive time)
+        self.proc = subprocess.Popen(
+            [os.path.abspath(args.binary), os.path.join(BASE, "nodes", "sync")],
+            env=env, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE,
+            universal_newlines=True,
+        )
+        self.reader = threading.Thread(target=self.read)
+        self.reader.start()
+
+    def read(self):
+        for line in self.proc.stderr:
+            received = time.monotonic()
+            self.log.append(line)
+            match = CLOCK.search(line)
+            if match:
+                self.offsets.append((received, float(match.group(1)) - received))
+
+    def stop(self):
+        self.proc.terminate()
+        self.proc.wait()
+        self.reader.join()
+
+    def offset(self, since):
+        return statistics.median(o for t, o in self.offsets if t >= since)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="info-beamer sync test")
+    parser.add_argument("--binary", default=os.path.join(REPO, "info-beamer"))
+    parser.add_argument("--port", type=int, default=14544)
+    parser.add_argument("--delay", type=float, default=2.0,
+                        help="start the follower that many seconds later")
+    parser.add_argument("--duration", type=float, default=5.0)
+    parser.add_argument("--tolerance", type=float, default=0.008,
+                        help="maximum clock difference in seconds")
+    args = parser.parse_args()
+
+    leader = Instance(args, "leader", args.port,
+                      "leader:127.0.0.1:%d" % (args.port + 1))
+    time.sleep(args.delay)
+    follower = Instance(args, "follower", args.port + 1, "follower")
+    time.sleep(args.duration)
+    settled = time.monotonic() - args.duration / 2
+
+    follower.stop()
+    leader.stop()
+
+    try:
+        diff = follower.offset(settled) - leader.offset(settled)
+    except statistics.StatisticsError:
+        for instance in (leader, follower):
+            sys.stderr.write("--- %s\n%s" % (instance.name, "".join(instance.log)))
+        sys.stderr.write("no clock output\n")
+        return 1
+
+    sys.stderr.write("follower clock is %+.2fms off\n" % (diff * 1000))
+    if abs(diff) > args.tolerance:
+        sys.stderr.write("".join(follower.log))
+        sys.stderr.write("failed: more than %.2fms\n" % (args.tolerance * 1000))
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
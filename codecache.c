@@ -0,0 +1,153 @@
+/* See Copyright Notice in LICENSE.txt */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "uthash.h"
+#include "misc.h"
+#include "codecache.h"
+
+/* Process wide cache of compiled chunks. Every node loads the same
+ * kernel and userlib and reloads its code whenever something changes,
+ * so compile each source once and keep the bytecode produced by
+ * lua_dump. Entries are keyed by chunkname and only used if the
+ * source is still the same. Only sources are cached: precompiled
+ * code is passed through, so the cache never loads bytecode it
+ * didn't produce itself. kernel.lua only uses the cache for the
+ * code loaded on reload, not for loadstring calls of nodes. */
+
+#define CODECACHE_MAX_SIZE (16 * 1024 * 1024) // bytes of cached sources and bytecode
+
+typedef struct entry_s {
+    char *chunkname;
+    uint64_t hash;
+    char *source;
+    size_t source_len;
+    char *bytecode;
+    size_t bytecode_len;
+    UT_hash_handle hh;
+} entry_t;
+
+// ordered from least to most recently used
+static entry_t *entries = NULL;
+static size_t cache_size = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t hash_source(const char *code, size_t len) {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)code[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void entry_free(entry_t *entry) {
+    HASH_DEL(entries, entry);
+    cache_size -= entry->source_len + entry->bytecode_len;
+    free(entry->chunkname);
+    free(entry->source);
+    free(entry->bytecode);
+    free(entry);
+}
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t size;
+} dump_t;
+
+static int dump_writer(lua_State *L, const void *p, size_t len, void *ud) {
+    dump_t *dump = ud;
+    if (dump->len + len > dump->size) {
+        size_t size = dump->size ? dump->size * 2 : 4096;
+        while (size < dump->len + len)
+            size *= 2;
+        char *data = realloc(dump->data, size);
+        if (!data)
+            return 1;
+        dump->data = data;
+        dump->size = size;
+    }
+    memcpy(dump->data + dump->len, p, len);
+    dump->len += len;
+    return 0;
+}
+
+int codecache_load(lua_State *L, const char *code, size_t len, const char *chunkname) {
+    if (len > 0 && code[0] == LUA_SIGNATURE[0])
+        return luaL_loadbuffer(L, code, len, chunkname);
+
+    uint64_t hash = hash_source(code, len);
+
+    pthread_mutex_lock(&lock);
+    entry_t *entry;
+    HASH_FIND_STR(entries, chunkname, entry);
+    if (entry && entry->hash == hash && entry->source_len == len &&
+            !memcmp(entry->source, code, len)) {
+        // move to the end of the lru order
+        HASH_DEL(entries, entry);
+        HASH_ADD_KEYPTR(hh, entries, entry->chunkname, strlen(entry->chunkname), entry);
+        int ret = luaL_loadbuffer(L, entry->bytecode, entry->bytecode_len, chunkname);
+        pthread_mutex_unlock(&lock);
+        return ret;
+    }
+    pthread_mutex_unlock(&lock);
+
+    int ret = luaL_loadbuffer(L, code, len, chunkname);
+    if (ret != 0)
+        return ret;
+
+    dump_t dump = {0};
+    if (lua_dump(L, dump_writer, &dump) != 0 || len + dump.len > CODECACHE_MAX_SIZE) {
+        free(dump.data);
+        return 0;
+    }
+
+    entry = xmalloc(sizeof(entry_t));
+    entry->chunkname = strdup(chunkname);
+    entry->hash = hash;
+    entry->source = xmalloc(len ? len : 1);
+    memcpy(entry->source, code, len);
+    entry->source_len = len;
+    entry->bytecode = dump.data;
+    entry->bytecode_len = dump.len;
+
+    pthread_mutex_lock(&lock);
+    entry_t *old;
+    HASH_FIND_STR(entries, chunkname, old);
+    if (old)
+        entry_free(old);
+    HASH_ADD_KEYPTR(hh, entries, entry->chunkname, strlen(entry->chunkname), entry);
+    cache_size += entry->source_len + entry->bytecode_len;
+    while (cache_size > CODECACHE_MAX_SIZE)
+        entry_free(entries);
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+// load_cached(code, chunkname): Same results as loadstring
+static int load_cached(lua_State *L) {
+    size_t len;
+    const char *code = luaL_checklstring(L, 1, &len);
+    const char *chunkname = luaL_checkstring(L, 2);
+    if (codecache_load(L, code, len, chunkname) != 0) {
+        lua_pushnil(L);
+        lua_insert(L, -2);
+        return 2;
+    }
+    return 1;
+}
+
+int luaopen_codecache(lua_State *L) {
+    lua_register(L, "load_cached", load_cached);
+    return 0;
+}
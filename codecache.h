@@ -0,0 +1,11 @@
+/* See Copyright Notice in LICENSE.txt */
+
+#ifndef CODECACHE_H
+#define CODECACHE_H
+
+#include <lua.h>
+
+int codecache_load(lua_State *L, const char *code, size_t len, const char *chunkname);
+int luaopen_codecache(lua_State *L);
+
+#endif
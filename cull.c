@@ -0,0 +1,212 @@
+/* See Copyright Notice in LICENSE.txt */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <GL/glew.h>
+#include <GL/gl.h>
+#include <lua.h>
+
+#include "shader.h"
+#include "cull.h"
+
+// How far outside the viewport cull_near still reports a quad,
+// as a share of the viewport size.
+#define NEAR_MARGIN 0.5
+
+// Modelview stack depth. That's the minimum GL guarantees.
+#define MAX_DEPTH 32
+
+// Copies of the matrices (column major) and the viewport, so
+// nothing has to be read back from GL while drawing. main.c
+// mirrors every change it makes to the GL state here.
+static double projection[16];
+static double modelview[MAX_DEPTH][16];
+static int depth = 0;
+static int viewport[4];
+
+static double mvp[16];      // projection * modelview, if valid
+static int valid = 0;
+
+static int *counter = NULL; // culled draws of the current node
+
+// out = a * b
+static void mult(double out[16], const double a[16], const double b[16]) {
+    for (int c = 0; c < 4; c++)
+        for (int r = 0; r < 4; r++)
+            out[c*4+r] = a[r]    * b[c*4]   + a[4+r]  * b[c*4+1] +
+                         a[8+r]  * b[c*4+2] + a[12+r] * b[c*4+3];
+}
+
+static void identity(double m[16]) {
+    for (int i = 0; i < 16; i++)
+        m[i] = i % 5 == 0;
+}
+
+// Called after a new projection and viewport were set up and the
+// modelview matrix was reset. Reads them back once per setup.
+void cull_reset() {
+    GLdouble p[16];
+    GLint v[4];
+    glGetDoublev(GL_PROJECTION_MATRIX, p);
+    glGetIntegerv(GL_VIEWPORT, v);
+    for (int i = 0; i < 16; i++)
+        projection[i] = p[i];
+    for (int i = 0; i < 4; i++)
+        viewport[i] = v[i];
+    identity(modelview[depth]);
+    valid = 0;
+}
+
+void cull_save(cull_state_t *state) {
+    memcpy(state->projection, projection, sizeof(projection));
+    memcpy(state->modelview, modelview[depth], sizeof(modelview[depth]));
+    memcpy(state->viewport, viewport, sizeof(viewport));
+}
+
+void cull_restore(const cull_state_t *state) {
+    memcpy(projection, state->projection, sizeof(projection));
+    memcpy(modelview[depth], state->modelview, sizeof(modelview[depth]));
+    memcpy(viewport, state->viewport, sizeof(viewport));
+    valid = 0;
+}
+
+// Like GL, pushes beyond the maximum depth and pops of the last
+// matrix are ignored.
+void cull_push() {
+    if (depth + 1 >= MAX_DEPTH)
+        return;
+    memcpy(modelview[depth + 1], modelview[depth], sizeof(modelview[depth]));
+    depth++;
+}
+
+void cull_pop() {
+    if (depth == 0)
+        return;
+    depth--;
+    valid = 0;
+}
+
+void cull_translate(double x, double y, double z) {
+    double *m = modelview[depth];
+    for (int r = 0; r < 4; r++)
+        m[12+r] += m[r] * x + m[4+r] * y + m[8+r] * z;
+    valid = 0;
+}
+
+void cull_scale(double x, double y, double z) {
+    double *m = modelview[depth];
+    for (int r = 0; r < 4; r++) {
+        m[r] *= x;
+        m[4+r] *= y;
+        m[8+r] *= z;
+    }
+    valid = 0;
+}
+
+// Same as glRotated: angle in degrees around the axis (x, y, z)
+void cull_rotate(double angle, double x, double y, double z) {
+    double len = sqrt(x * x + y * y + z * z);
+    if (len == 0)
+        return;
+    x /= len, y /= len, z /= len;
+    double a = angle * M_PI / 180;
+    double c = cos(a), s = sin(a), t = 1 - c;
+    const double rot[16] = {
+        x * x * t + c,     y * x * t + z * s, x * z * t - y * s, 0,
+        x * y * t - z * s, y * y * t + c,     y * z * t + x * s, 0,
+        x * z * t + y * s, y * z * t - x * s, z * z * t + c,     0,
+        0,                 0,                 0,                 1,
+    };
+    double m[16];
+    mult(m, modelview[depth], rot);
+    memcpy(modelview[depth], m, sizeof(m));
+    valid = 0;
+}
+
+// Transforms the quad with the current modelview and projection
+// matrices into its bounding box in normalized device coordinates.
+// Returns 0 if that's not possible.
+static int project(double x1, double y1, double x2, double y2, double box[4]) {
+    // A custom vertex shader might move the vertices anywhere
+    if (shader_current_program())
+        return 0;
+
+    if (!valid) {
+        mult(mvp, projection, modelview[depth]);
+        valid = 1;
+    }
+
+    const double *m = mvp;
+    const double corners[4][2] = {{x1, y1}, {x2, y1}, {x2, y2}, {x1, y2}};
+    double min_x = 1e30, min_y = 1e30, max_x = -1e30, max_y = -1e30;
+    for (int i = 0; i < 4; i++) {
+        double x = corners[i][0], y = corners[i][1];
+        double w = m[3] * x + m[7] * y + m[15];
+        if (w <= 0) // behind the camera: don't bother
+            return 0;
+        double nx = (m[0] * x + m[4] * y + m[12]) / w;
+        double ny = (m[1] * x + m[5] * y + m[13]) / w;
+        if (nx < min_x) min_x = nx;
+        if (nx > max_x) max_x = nx;
+        if (ny < min_y) min_y = ny;
+        if (ny > max_y) max_y = ny;
+    }
+    box[0] = min_x, box[1] = min_y, box[2] = max_x, box[3] = max_y;
+    return 1;
+}
+
+// Does the box overlap the viewport, grown by margin (a share
+// of the viewport size) on each side?
+static int overlaps(const double box[4], double margin) {
+    double edge = 1 + 2 * margin;
+    return box[2] >= -edge && box[0] <= edge && box[3] >= -edge && box[1] <= edge;
+}
+
+// Returns 0 if the quad is entirely outside the viewport
+int cull_visible(double x1, double y1, double x2, double y2) {
+    double box[4];
+    if (!project(x1, y1, x2, y2, box))
+        return 1;
+    return overlaps(box, 0);
+}
+
+// Like cull_visible, but also true close to the viewport. Quads
+// moving into view are then known before they become visible.
+int cull_near(double x1, double y1, double x2, double y2) {
+    double box[4];
+    if (!project(x1, y1, x2, y2, box))
+        return 1;
+    return overlaps(box, NEAR_MARGIN);
+}
+
+// Size of the quad on the current framebuffer in pixels.
+// Returns 0 if it is unknown.
+int cull_projected_size(double x1, double y1, double x2, double y2,
+        double *width, double *height)
+{
+    double box[4];
+    if (!project(x1, y1, x2, y2, box))
+        return 0;
+    *width = (box[2] - box[0]) * viewport[2] / 2;
+    *height = (box[3] - box[1]) * viewport[3] / 2;
+    return 1;
+}
+
+// Returns 1 if a draw of the quad can be skipped and counts it
+int cull_skip(double x1, double y1, double x2, double y2) {
+    if (cull_visible(x1, y1, x2, y2))
+        return 0;
+    if (counter)
+        (*counter)++;
+    return 1;
+}
+
+int *cull_swap_counter(int *new_counter) {
+    int *prev = counter;
+    counter = new_counter;
+    return prev;
+}
@@ -0,0 +1,27 @@
+/* See Copyright Notice in LICENSE.txt */
+
+#ifndef CULL_H
+#define CULL_H
+
+typedef struct {
+    double projection[16];
+    double modelview[16];
+    int viewport[4];
+} cull_state_t;
+
+void cull_reset();
+void cull_save(cull_state_t *state);
+void cull_restore(const cull_state_t *state);
+void cull_push();
+void cull_pop();
+void cull_translate(double x, double y, double z);
+void cull_scale(double x, double y, double z);
+void cull_rotate(double angle, double x, double y, double z);
+int cull_visible(double x1, double y1, double x2, double y2);
+int cull_near(double x1, double y1, double x2, double y2);
+int cull_skip(double x1, double y1, double x2, double y2);
+int cull_projected_size(double x1, double y1, double x2, double y2,
+        double *width, double *height);
+int *cull_swap_counter(int *counter);
+
+#endif
@@ -0,0 +1,21 @@
+/* See Copyright Notice in LICENSE.txt */
+
+#include <lauxlib.h>
+
+#include "fastpath.h"
+
+const char *fastpath_message(int code) {
+    switch (code) {
+        case FASTPATH_NOT_RENDER_THREAD: return "only callable on the render thread";
+        case FASTPATH_NOT_RENDERING:     return "only callable in node.render";
+        case FASTPATH_TOO_MANY_PUSHES:   return "Too may pushes";
+        case FASTPATH_NOTHING_TO_POP:    return "Nothing to pop";
+        case FASTPATH_INVALID_UTF8:      return "invalid utf8";
+        case FASTPATH_DISPOSED:          return "resource disposed";
+        default:                         return "unknown error";
+    }
+}
+
+int fastpath_error(lua_State *L, int code) {
+    return luaL_error(L, "%s", fastpath_message(code));
+}
@@ -0,0 +1,37 @@
+/* See Copyright Notice in LICENSE.txt */
+
+#ifndef FASTPATH_H
+#define FASTPATH_H
+
+#include <lua.h>
+
+/* Entry points for hot bindings that kernel.lua calls through the
+ * LuaJIT FFI: Unlike lua_CFunctions, FFI calls don't abort traces.
+ * They must never raise lua errors, so they return one of these codes.
+ * The classic bindings use the same functions. */
+
+#define FASTPATH_OK                 0
+#define FASTPATH_NOT_RENDER_THREAD -1
+#define FASTPATH_NOT_RENDERING     -2
+#define FASTPATH_TOO_MANY_PUSHES   -3
+#define FASTPATH_NOTHING_TO_POP    -4
+#define FASTPATH_INVALID_UTF8      -5
+#define FASTPATH_DISPOSED          -6
+
+const char *fastpath_message(int code);
+int fastpath_error(lua_State *L, int code);
+
+int fastpath_image_draw(void *image, double x1, double y1, double x2, double y2,
+        double alpha, double sx1, double sy1, double sx2, double sy2);
+int fastpath_video_draw(void *video, double x1, double y1, double x2, double y2,
+        double alpha, double sx1, double sy1, double sx2, double sy2);
+int fastpath_font_write(void *font, double x, double y, const char *text,
+        double size, double r, double g, double b, double a, double *width);
+
+int fastpath_gl_push_matrix(void *node);
+int fastpath_gl_pop_matrix(void *node);
+int fastpath_gl_rotate(void *node, double angle, double x, double y, double z);
+int fastpath_gl_translate(void *node, double x, double y, double z);
+int fastpath_gl_scale(void *node, double x, double y, double z);
+
+#endif
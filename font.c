@@ -2,6 +2,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <GL/gl.h>
@@ -11,6 +12,10 @@
 
 #include "misc.h"
 #include "shader.h"
+#include "worker.h"
+#include "fastpath.h"
+#include "release.h"
+#include "cull.h"
 
 typedef struct {
     FTGLfont *font;
@@ -21,8 +26,84 @@ LUA_TYPE_DECL(font)
 /* Instance methods */
 #define SCALE (72)
 
+#define MIN_RUN 64  // longer texts are rendered in runs ending at a space ...
+#define MAX_RUN 256 // ... or after that many bytes
+
+static void render_run(font_t *font, GLfloat x, GLfloat y, const char *text, GLfloat size) {
+    glPushMatrix();
+        glTranslatef(x, y, 0);
+        glTranslatef(0, size * (SCALE * 0.8), 0);
+        glScalef(size, -size, 1.0);
+        ftglRenderFont(font->font, text, FTGL_RENDER_ALL);
+    glPopMatrix();
+}
+
+// Glyphs may reach a bit beyond their advance and the line
+static int run_culled(GLfloat x, GLfloat y, GLfloat width, GLfloat size) {
+    GLfloat px = size * SCALE;
+    return cull_skip(x - px * 0.5, y - px * 0.5, x + width + px * 0.5, y + px * 1.5);
+}
+
+static const char *run_end(const char *text) {
+    const char *pos = text;
+    while (*pos) {
+        if (*pos == ' ' && pos - text >= MIN_RUN)
+            return pos + 1;
+        // only split between utf8 sequences
+        if (pos - text >= MAX_RUN && (*pos & 0xC0) != 0x80)
+            return pos;
+        pos++;
+    }
+    return pos;
+}
+
+// Long texts (like tickers) are split into runs, so only the
+// runs within the viewport are rendered.
+static GLfloat font_render(font_t *font, GLfloat x, GLfloat y, const char *text, GLfloat size) {
+    if (strlen(text) < MIN_RUN) {
+        GLfloat width = ftglGetFontAdvance(font->font, text) * size;
+        if (!run_culled(x, y, width, size))
+            render_run(font, x, y, text, size);
+        return width;
+    }
+
+    char run[MAX_RUN + 8];
+    GLfloat width = 0;
+    while (*text) {
+        const char *end = run_end(text);
+        memcpy(run, text, end - text);
+        run[end - text] = '\0';
+        GLfloat advance = ftglGetFontAdvance(font->font, run) * size;
+        if (!run_culled(x + width, y, advance, size))
+            render_run(font, x + width, y, run, size);
+        width += advance;
+        text = end;
+    }
+    return width;
+}
+
+// Only handles RGBA colors. kernel.lua uses the classic
+// binding for texture like values.
+int fastpath_font_write(void *obj, double x, double y, const char *text,
+        double size, double r, double g, double b, double a, double *width)
+{
+    if (!worker_on_render_thread())
+        return FASTPATH_NOT_RENDER_THREAD;
+    if (!((font_t*)obj)->font)
+        return FASTPATH_DISPOSED;
+    if (!check_utf8(text))
+        return FASTPATH_INVALID_UTF8;
+    shader_set_gl_color(r, g, b, a);
+    glBindTexture(GL_TEXTURE_2D, default_tex);
+    *width = font_render(obj, x, y, text, size / SCALE);
+    return FASTPATH_OK;
+}
+
 static int font_write(lua_State *L) {
+    require_render_thread(L);
     font_t *font = checked_font(L, 1);
+    if (!font->font)
+        return fastpath_error(L, FASTPATH_DISPOSED);
     GLfloat x = luaL_checknumber(L, 2);
     GLfloat y = luaL_checknumber(L, 3);
     const char *text = luaL_checkstring(L, 4);
@@ -60,28 +141,38 @@ static int font_write(lua_State *L) {
         return luaL_argerror(L, 6, "unsupported value. must be RGBA or texturelike");
     }
 
-    glPushMatrix();
-        glTranslatef(x, y, 0);
-        glTranslatef(0, size * (SCALE * 0.8), 0);
-        glScalef(size, -size, 1.0);
-        ftglRenderFont(font->font, text, FTGL_RENDER_ALL);
-    glPopMatrix();
-
-    lua_pushnumber(L, ftglGetFontAdvance(font->font, text) * size);
+    lua_pushnumber(L, font_render(font, x, y, text, size));
     return 1;
 }
 
 static int font_width(lua_State *L) {
     font_t *font = checked_font(L, 1);
+    if (!font->font)
+        return fastpath_error(L, FASTPATH_DISPOSED);
     const char *text = luaL_checkstring(L, 2);
     GLfloat size = luaL_checknumber(L, 3) / SCALE;
     lua_pushnumber(L, ftglGetFontAdvance(font->font, text) * size);
     return 1;
 }
 
+static void font_destroy(void *ptr) {
+    ftglDestroyFont(ptr);
+}
+
+static int font_dispose(lua_State *L) {
+    font_t *font = checked_font(L, 1);
+    if (font->font) {
+        // frees the glyph textures, so it has to run on the render thread
+        release_call(font_destroy, font->font);
+        font->font = NULL;
+    }
+    return 0;
+}
+
 static const luaL_reg font_methods[] = {
     {"write",       font_write},
     {"width",       font_width},
+    {"dispose",     font_dispose},
     {0,0}
 };
 
@@ -103,7 +194,8 @@ int font_new(lua_State *L, const char *path, const char *name) {
 
 static int font_gc(lua_State *L) {
     font_t *font = to_font(L, 1);
-    ftglDestroyFont(font->font);
+    if (font->font)
+        release_call(font_destroy, font->font);
     fprintf(stderr, INFO("gc'ing font\n"));
     return 0;
 }
@@ -9,6 +9,8 @@
 
 #include "utlist.h"
 #include "misc.h"
+#include "stats.h"
+#include "texture.h"
 
 #define MAX_CACHED 30
 
@@ -25,11 +27,19 @@ static framebuffer_t *framebuffers = NULL;
 static int num_framebuffers = 0;
 
 static void unlink_framebuffer(framebuffer_t *framebuffer) {
+    texture_account(TEXTURE_FBO, -texture_size(framebuffer->width, framebuffer->height, 1));
     DL_DELETE(framebuffers, framebuffer);
     free(framebuffer);
     num_framebuffers--;
 }
 
+static void delete_framebuffer(framebuffer_t *framebuffer) {
+    glDeleteFramebuffers(1, &framebuffer->fbo);
+    glDeleteTextures(1, &framebuffer->tex);
+    stats_texture(framebuffer->width, framebuffer->height, 0);
+    unlink_framebuffer(framebuffer);
+}
+
 void make_framebuffer(int width, int height, GLuint *tex, GLuint *fbo) {
     framebuffer_t *framebuffer, *tmp;
 
@@ -56,6 +66,7 @@ void make_framebuffer(int width, int height, GLuint *tex, GLuint *fbo) {
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_INT, NULL);
+    stats_texture(width, height, 1);
 
     glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, *tex, 0);
     if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
@@ -74,11 +85,16 @@ void recycle_framebuffer(int width, int height, GLuint tex, GLuint fbo) {
 
     DL_APPEND(framebuffers, framebuffer);
     num_framebuffers++;
+    texture_account(TEXTURE_FBO, texture_size(width, height, 1));
 
     if (num_framebuffers > MAX_CACHED) {
         fprintf(stderr, ERROR("too many framebuffers in use\n"));
-        glDeleteFramebuffers(1, &framebuffers->fbo);
-        glDeleteTextures(1, &framebuffers->tex);
-        unlink_framebuffer(framebuffers);
+        delete_framebuffer(framebuffers);
     }
 }
+
+// Frees all unused framebuffers
+void framebuffer_flush() {
+    while (framebuffers)
+        delete_framebuffer(framebuffers);
+}
@@ -7,5 +7,6 @@
 
 void make_framebuffer(int width, int height, GLuint *tex, GLuint *fbo);
 void recycle_framebuffer(int width, int height, GLuint tex, GLuint fbo);
+void framebuffer_flush();
 
 #endif
@@ -0,0 +1,120 @@
+/* See Copyright Notice in LICENSE.txt */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GL/gl.h>
+#include <IL/il.h>
+#include <IL/ilu.h>
+
+#include "misc.h"
+#include "headless.h"
+#include "image.h"
+
+static EGLDisplay display = EGL_NO_DISPLAY;
+static EGLSurface surface = EGL_NO_SURFACE;
+static EGLContext context = EGL_NO_CONTEXT;
+
+static EGLDisplay get_display() {
+    // Prefer Mesa's surfaceless platform: It doesn't need
+    // any X11/Wayland connection and works with the
+    // software rasterizer on build servers.
+    const char *extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    if (extensions && strstr(extensions, "EGL_MESA_platform_surfaceless")) {
+        PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+            (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+        if (get_platform_display) {
+            EGLDisplay surfaceless = get_platform_display(
+                EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+            if (surfaceless != EGL_NO_DISPLAY)
+                return surfaceless;
+        }
+    }
+    return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+}
+
+void headless_init(int width, int height) {
+    display = get_display();
+    if (display == EGL_NO_DISPLAY)
+        die("cannot get egl display");
+
+    EGLint major, minor;
+    if (!eglInitialize(display, &major, &minor))
+        die("cannot initialize egl: %04x", eglGetError());
+
+    fprintf(stderr, INFO("egl %d.%d (%s)\n"), major, minor,
+        eglQueryString(display, EGL_VENDOR));
+
+    static const EGLint config_attribs[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RED_SIZE, 8,
+        EGL_GREEN_SIZE, 8,
+        EGL_BLUE_SIZE, 8,
+        EGL_ALPHA_SIZE, 8,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_NONE
+    };
+
+    EGLConfig config;
+    EGLint num_configs;
+    if (!eglChooseConfig(display, config_attribs, &config, 1, &num_configs) ||
+            num_configs != 1)
+        die("no usable egl config found");
+
+    const EGLint surface_attribs[] = {
+        EGL_WIDTH, width,
+        EGL_HEIGHT, height,
+        EGL_NONE
+    };
+
+    surface = eglCreatePbufferSurface(display, config, surface_attribs);
+    if (surface == EGL_NO_SURFACE)
+        die("cannot create %dx%d pbuffer: %04x", width, height, eglGetError());
+
+    if (!eglBindAPI(EGL_OPENGL_API))
+        die("cannot bind opengl api");
+
+    context = eglCreateContext(display, config, EGL_NO_CONTEXT, NULL);
+    if (context == EGL_NO_CONTEXT)
+        die("cannot create egl context: %04x", eglGetError());
+
+    if (!eglMakeCurrent(display, surface, surface, context))
+        die("cannot activate egl context: %04x", eglGetError());
+
+    fprintf(stderr, INFO("headless rendering using %s\n"), glGetString(GL_RENDERER));
+}
+
+void headless_swap() {
+    // There is no display that could throttle us. Wait
+    // for the frame to complete, so frame times include
+    // the actual rendering work.
+    eglSwapBuffers(display, surface);
+    glFinish();
+}
+
+void headless_dump_frame(const char *path, int width, int height) {
+    unsigned char *pixels = xmalloc(width * height * 4);
+
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+
+    ILuint image_id;
+    image_lock_devil();
+    ilGenImages(1, &image_id);
+    ilBindImage(image_id);
+
+    // glReadPixels returns the image bottom-up, which
+    // matches DevIL's default origin.
+    ilTexImage(width, height, 1, 4, IL_RGBA, IL_UNSIGNED_BYTE, pixels);
+    ilEnable(IL_FILE_OVERWRITE);
+    if (!ilSaveImage(path))
+        fprintf(stderr, ERROR("cannot save frame %s: %s\n"),
+            path, iluErrorString(ilGetError()));
+
+    ilDeleteImages(1, &image_id);
+    image_unlock_devil();
+    free(pixels);
+}
@@ -0,0 +1,10 @@
+/* See Copyright Notice in LICENSE.txt */
+
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+void headless_init(int width, int height);
+void headless_swap();
+void headless_dump_frame(const char *path, int width, int height);
+
+#endif
@@ -1,8 +1,11 @@
 /* See Copyright Notice in LICENSE.txt */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include <GL/glew.h>
 #include <GL/gl.h>
@@ -15,13 +18,29 @@
 #include "misc.h"
 #include "image.h"
 #include "shader.h"
+#include "stats.h"
+#include "worker.h"
+#include "fastpath.h"
+#include "preload.h"
+#include "texture.h"
+#include "release.h"
+#include "cull.h"
 
 typedef struct {
+    texture_t texture;  // first member, see image_evict
     GLuint tex;
     GLuint fbo;
-    int width;
+    int width;          // size reported to lua
     int height;
+    int tex_width;      // size of the texture. Smaller than the
+    int tex_height;     // above for children rendered scaled down.
     int flipped;
+    preload_t *preload; // still loading in the background
+    char *error;        // background loading failed
+    char *path;         // file the image can be reloaded from
+    int disposed;
+    void *source;       // node rendered into this image ...
+    int source_frame;   // ... in that frame
 } image_t;
 
 LUA_TYPE_DECL(image)
@@ -30,6 +49,17 @@ LUA_TYPE_DECL(image)
 
 static int image_state(lua_State *L) {
     image_t *image = checked_image(L, 1);
+    if (image->disposed) {
+        lua_pushliteral(L, "disposed");
+        return 1;
+    } else if (image->preload) {
+        lua_pushliteral(L, "loading");
+        return 1;
+    } else if (image->error) {
+        lua_pushliteral(L, "error");
+        lua_pushstring(L, image->error);
+        return 2;
+    }
     lua_pushliteral(L, "loaded");
     lua_pushnumber(L, image->width);
     lua_pushnumber(L, image->height);
@@ -43,17 +73,35 @@ static int image_size(lua_State *L) {
     return 2;
 }
 
-static int image_draw(lua_State *L) {
-    image_t *image = checked_image(L, 1);
-    GLfloat x1 = luaL_checknumber(L, 2);
-    GLfloat y1 = luaL_checknumber(L, 3);
-    GLfloat x2 = luaL_checknumber(L, 4);
-    GLfloat y2 = luaL_checknumber(L, 5);
-    GLfloat alpha = luaL_optnumber(L, 6, 1.0);
-    GLfloat sx1 = luaL_optnumber(L, 7, 0);
-    GLfloat sy1 = luaL_optnumber(L, 8, 0);
-    GLfloat sx2 = luaL_optnumber(L, 9, 1);
-    GLfloat sy2 = luaL_optnumber(L, 10, 1);
+// Marks the texture as used in this frame. An evicted image
+// is loaded again in the background and 0 is returned.
+static int image_use(image_t *image) {
+    if (!image->tex) {
+        if (image->path && !image->preload && !image->error)
+            image->preload = preload_queue(image->path, 0, image->texture.owner, image);
+        return 0;
+    }
+    texture_drawn(&image->texture);
+    return 1;
+}
+
+int fastpath_image_draw(void *obj, double x1, double y1, double x2, double y2,
+        double alpha, double sx1, double sy1, double sx2, double sy2)
+{
+    if (!worker_on_render_thread())
+        return FASTPATH_NOT_RENDER_THREAD;
+    image_t *image = obj;
+    if (image->disposed)
+        return FASTPATH_DISPOSED;
+    if (image->source && image->source_frame == texture_frame()) {
+        double width = 0, height = 0;
+        cull_projected_size(x1, y1, x2, y2, &width, &height);
+        node_image_drawn(image->source, cull_near(x1, y1, x2, y2), width, height);
+    }
+    if (cull_skip(x1, y1, x2, y2))
+        return FASTPATH_OK;
+    if (!image_use(image))
+        return FASTPATH_OK;
 
     glBindTexture(GL_TEXTURE_2D, image->tex);
     shader_set_gl_color(1.0, 1.0, 1.0, alpha);
@@ -71,17 +119,42 @@ static int image_draw(lua_State *L) {
         glTexCoord2f(sx1, sy2); glVertex3f(x1, y2, 0);
     }
     glEnd();
+    return FASTPATH_OK;
+}
 
+static int image_draw(lua_State *L) {
+    image_t *image = checked_image(L, 1);
+    GLfloat x1 = luaL_checknumber(L, 2);
+    GLfloat y1 = luaL_checknumber(L, 3);
+    GLfloat x2 = luaL_checknumber(L, 4);
+    GLfloat y2 = luaL_checknumber(L, 5);
+    GLfloat alpha = luaL_optnumber(L, 6, 1.0);
+    GLfloat sx1 = luaL_optnumber(L, 7, 0);
+    GLfloat sy1 = luaL_optnumber(L, 8, 0);
+    GLfloat sx2 = luaL_optnumber(L, 9, 1);
+    GLfloat sy2 = luaL_optnumber(L, 10, 1);
+    int ret = fastpath_image_draw(image, x1, y1, x2, y2, alpha, sx1, sy1, sx2, sy2);
+    if (ret != FASTPATH_OK)
+        return fastpath_error(L, ret);
     return 0;
 }
 
 static int image_texid(lua_State *L) {
     image_t *image = checked_image(L, 1);
+    // Used as a shader uniform or font texture. Keep it
+    // loaded like a drawn image.
+    if (worker_on_render_thread())
+        image_use(image);
     lua_pushnumber(L, image->tex);
     return 1;
 }
 
+static void image_release(image_t *image);
+
 static int image_dispose(lua_State *L) {
+    image_t *image = checked_image(L, 1);
+    image_release(image);
+    image->disposed = 1;
     return 0;
 }
 
@@ -96,13 +169,42 @@ static const luaL_reg image_methods[] = {
 
 /* Lifecycle */
 
-int image_create(lua_State *L, GLuint tex, GLuint fbo, int width, int height, int flipped) {
+static image_t *image_new(lua_State *L, texture_type type) {
     image_t *image = push_image(L);
+    memset(image, 0, sizeof(image_t));
+    texture_init(&image->texture, type);
+    return image;
+}
+
+static void image_set_texture(image_t *image, GLuint tex, int width, int height, int mipmap) {
     image->tex = tex;
+    image->width = image->tex_width = width;
+    image->height = image->tex_height = height;
+    texture_add(&image->texture, texture_size(width, height, mipmap));
+}
+
+// Called by the texture registry if the texture budget is exceeded
+static void image_evict(texture_t *texture) {
+    image_t *image = (image_t*)texture;
+    release_texture(image->tex, image->tex_width, image->tex_height, 1);
+    image->tex = 0;
+}
+
+// tex_width/tex_height is the size of the texture, width/height the
+// size reported to lua. Without a texture, the image draws nothing
+// (like a culled child).
+int image_create(lua_State *L, GLuint tex, GLuint fbo, int tex_width, int tex_height,
+        int width, int height, int flipped, void *source)
+{
+    image_t *image = image_new(L, TEXTURE_FBO);
     image->fbo = fbo;
+    image->flipped = flipped;
+    image->source = source;
+    image->source_frame = texture_frame();
+    if (tex)
+        image_set_texture(image, tex, tex_width, tex_height, 1);
     image->width = width;
     image->height = height;
-    image->flipped = flipped;
     return 1;
 }
 
@@ -122,7 +224,11 @@ int image_from_current_framebuffer(lua_State *L, int x, int y, int width, int he
     glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, x, y, width, height);
     if (mipmap)
         glGenerateMipmap(GL_TEXTURE_2D);
-    return image_create(L, tex, 0, width, height, 1);
+    stats_texture(width, height, 1);
+    image_t *image = image_new(L, TEXTURE_SNAPSHOT);
+    image->flipped = 1;
+    image_set_texture(image, tex, width, height, mipmap);
+    return 1;
 }
 
 int image_from_color(lua_State *L, GLfloat r, GLfloat g, GLfloat b, GLfloat a) {
@@ -137,36 +243,53 @@ int image_from_color(lua_State *L, GLfloat r, GLfloat g, GLfloat b, GLfloat a) {
 
     unsigned char buf[4] = {r * 255, g * 255, b * 255, a * 255 };
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, buf);
+    stats_texture(1, 1, 1);
 
-    return image_create(L, tex, 0, 1, 1, 0);
+    image_t *image = image_new(L, TEXTURE_IMAGE);
+    image_set_texture(image, tex, 1, 1, 0);
+    return 1;
 }
 
 
-int image_load(lua_State *L, const char *path, const char *name) {
-    ILuint imageID;
-    ilGenImages(1, &imageID);
-    ilBindImage(imageID);
+// DevIL keeps global state. Images are also decoded on the
+// preload thread, so every user of DevIL has to hold this lock.
+static pthread_mutex_t devil_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void image_lock_devil() {
+    pthread_mutex_lock(&devil_lock);
+}
+
+void image_unlock_devil() {
+    pthread_mutex_unlock(&devil_lock);
+}
+
+// Loads path as RGBA into a new bound DevIL image
+static int devil_load(const char *path, ILuint *image_id, char *error, size_t error_size) {
+    ilGenImages(1, image_id);
+    ilBindImage(*image_id);
  
     if (!ilLoadImage(path)) {
-        ilDeleteImages(1, &imageID);
-        return luaL_error(L, "loading %s failed: %s",
+        snprintf(error, error_size, "loading %s failed: %s",
             path, iluErrorString(ilGetError()));
+        ilDeleteImages(1, image_id);
+        return 0;
     }
- 
-    ILinfo ImageInfo;
-    iluGetImageInfo(&ImageInfo);
 
     if (!ilConvertImage(IL_RGBA, IL_UNSIGNED_BYTE)) {
-        ilDeleteImages(1, &imageID);
-        return luaL_error(L, "converting %s failed: %s",
+        snprintf(error, error_size, "converting %s failed: %s",
             path, iluErrorString(ilGetError()));
+        ilDeleteImages(1, image_id);
+        return 0;
     }
+    return 1;
+}
 
-    int width = ilGetInteger(IL_IMAGE_WIDTH);
-    int height = ilGetInteger(IL_IMAGE_HEIGHT);
-
-    GLuint tex;
-    glGenTextures(1, &tex);
+static GLuint upload_texture(int width, int height, const void *pixels) {
+    // same sized images (like in a slideshow) reuse the storage
+    GLuint tex = release_reuse_texture(width, height);
+    int reused = tex != 0;
+    if (!reused)
+        glGenTextures(1, &tex);
     glBindTexture(GL_TEXTURE_2D, tex);
 
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR_MIPMAP_LINEAR);
@@ -174,26 +297,118 @@ int image_load(lua_State *L, const char *path, const char *name) {
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 
-    glTexImage2D(GL_TEXTURE_2D, 0, ilGetInteger(IL_IMAGE_BPP), width, height, 0,
-                 ilGetInteger(IL_IMAGE_FORMAT), GL_UNSIGNED_BYTE, ilGetData());
+    if (reused) {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height,
+                        GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+    } else {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0,
+                     GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+    }
     glGenerateMipmap(GL_TEXTURE_2D);
-    ilDeleteImages(1, &imageID);
-    return image_create(L, tex, 0, width, height, 0);
+    stats_texture(width, height, 1);
+    return tex;
 }
 
-static int image_gc(lua_State *L) {
-    image_t *image = to_image(L, 1);
-    if (image->fbo) {
+// Decodes path into RGBA pixels. Callable from any thread.
+int image_decode(const char *path, int *width, int *height,
+        unsigned char **pixels, char *error, size_t error_size)
+{
+    ILuint image_id;
+    image_lock_devil();
+    if (!devil_load(path, &image_id, error, error_size)) {
+        image_unlock_devil();
+        return 0;
+    }
+    *width = ilGetInteger(IL_IMAGE_WIDTH);
+    *height = ilGetInteger(IL_IMAGE_HEIGHT);
+    size_t size = (size_t)*width * *height * 4;
+    *pixels = xmalloc(size);
+    memcpy(*pixels, ilGetData(), size);
+    ilDeleteImages(1, &image_id);
+    image_unlock_devil();
+    return 1;
+}
+
+int image_load(lua_State *L, const char *path, const char *name) {
+    char error[256];
+    ILuint image_id;
+    image_lock_devil();
+    if (!devil_load(path, &image_id, error, sizeof(error))) {
+        image_unlock_devil();
+        return luaL_error(L, "%s", error);
+    }
+    int width = ilGetInteger(IL_IMAGE_WIDTH);
+    int height = ilGetInteger(IL_IMAGE_HEIGHT);
+    GLuint tex = upload_texture(width, height, ilGetData());
+    ilDeleteImages(1, &image_id);
+    image_unlock_devil();
+    image_t *image = image_new(L, TEXTURE_IMAGE);
+    image->path = strdup(path);
+    image->texture.evict = image_evict;
+    image_set_texture(image, tex, width, height, 1);
+    return 1;
+}
+
+// Returns an image that is still loading. The preload thread
+// decodes it, image_finish_preload uploads it later.
+int image_preload(lua_State *L, const char *path, int priority) {
+    if (access(path, R_OK) == -1)
+        return luaL_error(L, "cannot open %s", path);
+    image_t *image = image_new(L, TEXTURE_IMAGE);
+    image->path = strdup(path);
+    image->texture.evict = image_evict;
+    image->preload = preload_queue(path, priority, image->texture.owner, image);
+    return 1;
+}
+
+// Uploads one finished preload. Returns 0 if there was none.
+int image_finish_preload() {
+    preload_t *job = preload_finished();
+    if (!job)
+        return 0;
+    image_t *image = job->image;
+    if (job->state == PRELOAD_DECODED) {
+        GLuint tex = upload_texture(job->width, job->height, job->pixels);
+        image_set_texture(image, tex, job->width, job->height, 1);
+    } else {
+        image->error = strdup(job->error);
+    }
+    image->preload = NULL;
+    preload_free(job);
+    return 1;
+}
+
+// Frees everything. Called by dispose and again by gc.
+static void image_release(image_t *image) {
+    texture_remove(&image->texture);
+    if (image->preload) {
+        preload_cancel(image->preload);
+    } else if (!image->tex) {
+        // failed preload, evicted or already released
+    } else if (image->fbo) {
         // If images has attached Framebuffer, put the
         // texture and framebuffer into the recycler.
         // Allocations for new framebuffers can then
         // reuse these => Better performance.
-        recycle_framebuffer(image->width, image->height, 
-            image->tex, image->fbo);
+        release_framebuffer(image->tex, image->fbo,
+            image->tex_width, image->tex_height);
     } else {
-        // No Framebuffer? Just remove the texture.
-        glDeleteTextures(1, &image->tex);
+        // No Framebuffer? Just remove the texture. Textures
+        // from files can be reused by the next upload.
+        release_texture(image->tex, image->tex_width, image->tex_height,
+            image->path != NULL);
     }
+    free(image->path);
+    free(image->error);
+    image->preload = NULL;
+    image->tex = 0;
+    image->fbo = 0;
+    image->path = NULL;
+    image->error = NULL;
+}
+
+static int image_gc(lua_State *L) {
+    image_release(to_image(L, 1));
     return 0;
 }
 
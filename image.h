@@ -4,9 +4,21 @@
 #define IMAGE_H
 
 int image_register(lua_State *L);
-int image_create(lua_State *L, GLuint tex, GLuint fbo, int width, int height, int flipped);
+int image_create(lua_State *L, GLuint tex, GLuint fbo, int tex_width, int tex_height,
+        int width, int height, int flipped, void *source);
 int image_from_current_framebuffer(lua_State *L, int x, int y, int width, int height, int mipmap);
 int image_from_color(lua_State *L, GLfloat r, GLfloat g, GLfloat b, GLfloat a);
 int image_load(lua_State *L, const char *path, const char *name);
+int image_decode(const char *path, int *width, int *height,
+        unsigned char **pixels, char *error, size_t error_size);
+int image_preload(lua_State *L, const char *path, int priority);
+int image_finish_preload();
+void image_lock_devil();
+void image_unlock_devil();
+
+// Implemented in main.c. Called when an image of a rendered
+// child node is drawn in the frame it was rendered in. width
+// and height are the drawn size in pixels, 0 if unknown.
+void node_image_drawn(void *node, int visible, double width, double height);
 
 #endif
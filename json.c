@@ -0,0 +1,854 @@
+/* See Copyright Notice in LICENSE.txt */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "json.h"
+
+/* Native replacement for the bundled module_json.lua with the same
+ * api: json.encode(value), json.decode(string [, pos]) and json.null.
+ * Like the lua version, null decodes to nil (and is skipped in arrays)
+ * and the decoder accepts C style comments and single quoted strings.
+ * json.stream(handler) additionally decodes values arriving in chunks. */
+
+#define MAX_DEPTH 512
+
+#define NUMBER_FMT "%.14g" // same as tostring()
+
+static const char null_key = 'n'; // registry key of json.null
+
+/*==== Decoder ====*/
+
+typedef struct {
+    lua_State *L;
+    const char *start;
+    const char *pos;
+    const char *end;
+    int depth;
+} decoder_t;
+
+static void decode_value(decoder_t *d);
+
+static void decode_error(decoder_t *d, const char *msg) {
+    luaL_error(d->L, "json: %s at position %d", msg, (int)(d->pos - d->start) + 1);
+}
+
+static int is_number_char(char c) {
+    return (c >= '0' && c <= '9') || c == '-' || c == '+' ||
+            c == '.' || c == 'e' || c == 'E';
+}
+
+static void skip_whitespace(decoder_t *d) {
+    while (d->pos < d->end) {
+        char c = *d->pos;
+        if (c == ' ' || c == '\n' || c == '\r' || c == '\t') {
+            d->pos++;
+        } else if (c == '/' && d->pos + 1 < d->end && d->pos[1] == '*') {
+            const char *p = d->pos + 2;
+            while (p + 1 < d->end && !(p[0] == '*' && p[1] == '/'))
+                p++;
+            if (p + 1 >= d->end)
+                decode_error(d, "unterminated comment");
+            d->pos = p + 2;
+        } else {
+            break;
+        }
+    }
+}
+
+static int parse_hex4(const char *p, unsigned int *out) {
+    unsigned int value = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = p[i];
+        value <<= 4;
+        if (c >= '0' && c <= '9') {
+            value |= c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            value |= c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            value |= c - 'A' + 10;
+        } else {
+            return 0;
+        }
+    }
+    *out = value;
+    return 1;
+}
+
+static int utf8_encode(char *out, unsigned int cp) {
+    if (cp < 0x80) {
+        out[0] = cp;
+        return 1;
+    } else if (cp < 0x800) {
+        out[0] = 0xc0 | (cp >> 6);
+        out[1] = 0x80 | (cp & 0x3f);
+        return 2;
+    } else if (cp < 0x10000) {
+        out[0] = 0xe0 | (cp >> 12);
+        out[1] = 0x80 | ((cp >> 6) & 0x3f);
+        out[2] = 0x80 | (cp & 0x3f);
+        return 3;
+    } else {
+        out[0] = 0xf0 | (cp >> 18);
+        out[1] = 0x80 | ((cp >> 12) & 0x3f);
+        out[2] = 0x80 | ((cp >> 6) & 0x3f);
+        out[3] = 0x80 | (cp & 0x3f);
+        return 4;
+    }
+}
+
+static void decode_string(decoder_t *d) {
+    lua_State *L = d->L;
+    char quote = *d->pos++;
+    const char *p = d->pos;
+
+    // Fast path: no escape sequences. Push directly from the input.
+    while (p < d->end && *p != quote && *p != '\\')
+        p++;
+    if (p >= d->end)
+        decode_error(d, "unterminated string");
+    if (*p == quote) {
+        lua_pushlstring(L, d->pos, p - d->pos);
+        d->pos = p + 1;
+        return;
+    }
+
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    const char *segment = d->pos;
+    while (1) {
+        while (p < d->end && *p != quote && *p != '\\')
+            p++;
+        if (p >= d->end)
+            decode_error(d, "unterminated string");
+        if (*p == quote)
+            break;
+
+        luaL_addlstring(&b, segment, p - segment);
+        if (++p >= d->end)
+            decode_error(d, "unterminated string");
+        switch (*p++) {
+            case '"':  luaL_addchar(&b, '"');  break;
+            case '\'': luaL_addchar(&b, '\''); break;
+            case '\\': luaL_addchar(&b, '\\'); break;
+            case '/':  luaL_addchar(&b, '/');  break;
+            case 'b':  luaL_addchar(&b, '\b'); break;
+            case 'f':  luaL_addchar(&b, '\f'); break;
+            case 'n':  luaL_addchar(&b, '\n'); break;
+            case 'r':  luaL_addchar(&b, '\r'); break;
+            case 't':  luaL_addchar(&b, '\t'); break;
+            case 'u': {
+                unsigned int cp = 0, low = 0;
+                if (d->end - p < 4 || !parse_hex4(p, &cp)) {
+                    d->pos = p - 2;
+                    decode_error(d, "invalid unicode escape");
+                }
+                p += 4;
+                if (cp >= 0xd800 && cp <= 0xdbff) {
+                    // surrogate pair
+                    if (d->end - p >= 6 && p[0] == '\\' && p[1] == 'u' &&
+                            parse_hex4(p + 2, &low) && low >= 0xdc00 && low <= 0xdfff) {
+                        cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                        p += 6;
+                    } else {
+                        cp = 0xfffd;
+                    }
+                } else if (cp >= 0xdc00 && cp <= 0xdfff) {
+                    cp = 0xfffd;
+                }
+                char utf8[4];
+                luaL_addlstring(&b, utf8, utf8_encode(utf8, cp));
+                break;
+            }
+            default:
+                d->pos = p - 2;
+                decode_error(d, "invalid escape sequence");
+        }
+        segment = p;
+    }
+    luaL_addlstring(&b, segment, p - segment);
+    luaL_pushresult(&b);
+    d->pos = p + 1;
+}
+
+static void decode_number(decoder_t *d) {
+    const char *p = d->pos;
+
+    // Fast path for integers
+    int negative = *p == '-';
+    if (negative)
+        p++;
+    const char *digits = p;
+    long long value = 0;
+    while (p < d->end && *p >= '0' && *p <= '9' && p - digits < 15)
+        value = value * 10 + *p++ - '0';
+    if (p > digits && (p >= d->end || !is_number_char(*p))) {
+        lua_pushnumber(d->L, negative ? -value : value);
+        d->pos = p;
+        return;
+    }
+
+    // Everything else is handled by strtod
+    p = d->pos;
+    while (p < d->end && is_number_char(*p))
+        p++;
+    char number[64];
+    size_t len = p - d->pos;
+    if (len == 0 || len >= sizeof(number))
+        decode_error(d, "invalid number");
+    memcpy(number, d->pos, len);
+    number[len] = '\0';
+    char *number_end;
+    double parsed = strtod(number, &number_end);
+    if (number_end != number + len)
+        decode_error(d, "invalid number");
+    lua_pushnumber(d->L, parsed);
+    d->pos = p;
+}
+
+static void decode_literal(decoder_t *d, const char *literal, size_t len) {
+    if ((size_t)(d->end - d->pos) < len || memcmp(d->pos, literal, len))
+        decode_error(d, "unexpected character");
+    d->pos += len;
+}
+
+static void decode_array(decoder_t *d) {
+    lua_State *L = d->L;
+    int n = 0;
+    d->pos++;
+    lua_newtable(L);
+    skip_whitespace(d);
+    if (d->pos < d->end && *d->pos == ']') {
+        d->pos++;
+        return;
+    }
+    while (1) {
+        decode_value(d);
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1); // same as module_json.lua
+        } else {
+            lua_rawseti(L, -2, ++n);
+        }
+        skip_whitespace(d);
+        if (d->pos >= d->end)
+            decode_error(d, "unterminated array");
+        if (*d->pos == ']') {
+            d->pos++;
+            return;
+        }
+        if (*d->pos != ',')
+            decode_error(d, "expected ',' or ']'");
+        d->pos++;
+    }
+}
+
+static void decode_object(decoder_t *d) {
+    lua_State *L = d->L;
+    d->pos++;
+    lua_newtable(L);
+    skip_whitespace(d);
+    if (d->pos < d->end && *d->pos == '}') {
+        d->pos++;
+        return;
+    }
+    while (1) {
+        skip_whitespace(d);
+        if (d->pos >= d->end || (*d->pos != '"' && *d->pos != '\''))
+            decode_error(d, "expected string key");
+        decode_string(d);
+        skip_whitespace(d);
+        if (d->pos >= d->end || *d->pos != ':')
+            decode_error(d, "expected ':'");
+        d->pos++;
+        decode_value(d);
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 2);
+        } else {
+            lua_rawset(L, -3);
+        }
+        skip_whitespace(d);
+        if (d->pos >= d->end)
+            decode_error(d, "unterminated object");
+        if (*d->pos == '}') {
+            d->pos++;
+            return;
+        }
+        if (*d->pos != ',')
+            decode_error(d, "expected ',' or '}'");
+        d->pos++;
+    }
+}
+
+static void decode_value(decoder_t *d) {
+    skip_whitespace(d);
+    if (d->pos >= d->end)
+        decode_error(d, "unexpected end of input");
+    switch (*d->pos) {
+        case '{':
+        case '[':
+            if (++d->depth > MAX_DEPTH)
+                decode_error(d, "nesting too deep");
+            luaL_checkstack(d->L, 3, "json nesting too deep");
+            if (*d->pos == '{') {
+                decode_object(d);
+            } else {
+                decode_array(d);
+            }
+            d->depth--;
+            break;
+        case '"':
+        case '\'':
+            decode_string(d);
+            break;
+        case 't':
+            decode_literal(d, "true", 4);
+            lua_pushboolean(d->L, 1);
+            break;
+        case 'f':
+            decode_literal(d, "false", 5);
+            lua_pushboolean(d->L, 0);
+            break;
+        case 'n':
+            decode_literal(d, "null", 4);
+            lua_pushnil(d->L);
+            break;
+        default:
+            if (!is_number_char(*d->pos))
+                decode_error(d, "unexpected character");
+            decode_number(d);
+    }
+}
+
+static int json_decode(lua_State *L) {
+    size_t len;
+    const char *s = luaL_checklstring(L, 1, &len);
+    lua_Integer start = luaL_optinteger(L, 2, 1);
+    luaL_argcheck(L, start >= 1 && start <= (lua_Integer)len + 1, 2, "position out of range");
+    decoder_t d = {
+        .L = L,
+        .start = s,
+        .pos = s + start - 1,
+        .end = s + len,
+        .depth = 0,
+    };
+    decode_value(&d);
+    lua_pushinteger(L, d.pos - s + 1);
+    return 2;
+}
+
+/*==== Encoder ====*/
+
+typedef struct {
+    lua_State *L;
+    char *data;
+    size_t len;
+    size_t size;
+    int slot; // stack index of the userdata holding data
+    int null; // stack index of json.null
+} encoder_t;
+
+static void encoder_reserve(encoder_t *e, size_t needed) {
+    if (e->len + needed <= e->size)
+        return;
+    size_t size = e->size * 2;
+    while (size < e->len + needed)
+        size *= 2;
+    // Keep the buffer in a userdata, so it's collected
+    // if encoding fails with an error.
+    char *data = lua_newuserdata(e->L, size);
+    memcpy(data, e->data, e->len);
+    lua_replace(e->L, e->slot);
+    e->data = data;
+    e->size = size;
+}
+
+static void encoder_add(encoder_t *e, const char *s, size_t len) {
+    encoder_reserve(e, len);
+    memcpy(e->data + e->len, s, len);
+    e->len += len;
+}
+
+#define encoder_add_literal(e, s) encoder_add(e, "" s, sizeof(s) - 1)
+
+static void encoder_add_char(encoder_t *e, char c) {
+    encoder_reserve(e, 1);
+    e->data[e->len++] = c;
+}
+
+static void encode_string(encoder_t *e, const char *s, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    const char *end = s + len;
+    const char *segment = s;
+    encoder_reserve(e, len + 2);
+    e->data[e->len++] = '"';
+    for (const char *p = s; p < end; p++) {
+        unsigned char c = *p;
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+        encoder_add(e, segment, p - segment);
+        switch (c) {
+            case '"':  encoder_add_literal(e, "\\\""); break;
+            case '\\': encoder_add_literal(e, "\\\\"); break;
+            case '\n': encoder_add_literal(e, "\\n"); break;
+            case '\r': encoder_add_literal(e, "\\r"); break;
+            case '\t': encoder_add_literal(e, "\\t"); break;
+            case '\b': encoder_add_literal(e, "\\b"); break;
+            case '\f': encoder_add_literal(e, "\\f"); break;
+            default: {
+                char escaped[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 15]};
+                encoder_add(e, escaped, sizeof(escaped));
+            }
+        }
+        segment = p + 1;
+    }
+    encoder_add(e, segment, end - segment);
+    encoder_add_char(e, '"');
+}
+
+static void encode_number(encoder_t *e, lua_Number value) {
+    char number[32];
+    int len;
+    if (isnan(value) || isinf(value))
+        luaL_error(e->L, "json: cannot encode nan or inf");
+    if (fabs(value) < 1e14 && value == (long long)value) {
+        // Fast path for integers. Same output as NUMBER_FMT.
+        long long integer = value;
+        unsigned long long digits = integer < 0 ? -integer : integer;
+        char *p = number + sizeof(number);
+        do {
+            *--p = '0' + digits % 10;
+            digits /= 10;
+        } while (digits);
+        if (integer < 0)
+            *--p = '-';
+        encoder_add(e, p, number + sizeof(number) - p);
+    } else {
+        len = snprintf(number, sizeof(number), NUMBER_FMT, value);
+        encoder_add(e, number, len);
+    }
+}
+
+static int is_encodable(encoder_t *e, int idx) {
+    switch (lua_type(e->L, idx)) {
+        case LUA_TNIL:
+        case LUA_TBOOLEAN:
+        case LUA_TNUMBER:
+        case LUA_TSTRING:
+        case LUA_TTABLE:
+            return 1;
+        case LUA_TFUNCTION:
+            return lua_rawequal(e->L, idx, e->null);
+        default:
+            return 0;
+    }
+}
+
+static void encode_value(encoder_t *e, int idx, int depth);
+
+static void encode_table(encoder_t *e, int idx, int depth) {
+    lua_State *L = e->L;
+    if (depth > MAX_DEPTH)
+        luaL_error(L, "json: nesting too deep (cyclic table?)");
+    luaL_checkstack(L, 4, "json nesting too deep");
+
+    // Same rules as in module_json.lua: A table is an array if
+    // all encodable values are stored at positive integer keys.
+    int is_array = 1;
+    lua_Number max_index = 0;
+    int num_items = 0;
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+        int key_type = lua_type(L, -2);
+        lua_Number key = key_type == LUA_TNUMBER ? lua_tonumber(L, -2) : 0;
+        if (key >= 1 && floor(key) == key) {
+            if (!is_encodable(e, -1)) {
+                is_array = 0;
+                lua_pop(L, 2);
+                break;
+            }
+            if (key > max_index)
+                max_index = key;
+            num_items++;
+        } else if (key_type == LUA_TSTRING && !strcmp(lua_tostring(L, -2), "n")) {
+            if (lua_type(L, -1) != LUA_TNUMBER ||
+                    lua_tonumber(L, -1) != lua_objlen(L, idx)) {
+                is_array = 0;
+                lua_pop(L, 2);
+                break;
+            }
+        } else if (is_encodable(e, -1)) {
+            is_array = 0;
+            lua_pop(L, 2);
+            break;
+        }
+        lua_pop(L, 1);
+    }
+
+    // Unlike module_json.lua, don't blow up sparse arrays
+    // into huge lists of nulls.
+    if (is_array && max_index > 2 * num_items + 64)
+        is_array = 0;
+
+    if (is_array) {
+        encoder_add_char(e, '[');
+        for (int i = 1; i <= max_index; i++) {
+            if (i > 1)
+                encoder_add_char(e, ',');
+            lua_rawgeti(L, idx, i);
+            encode_value(e, lua_gettop(L), depth + 1);
+            lua_pop(L, 1);
+        }
+        encoder_add_char(e, ']');
+    } else {
+        int first = 1;
+        encoder_add_char(e, '{');
+        lua_pushnil(L);
+        while (lua_next(L, idx)) {
+            int key_type = lua_type(L, -2);
+            if ((key_type == LUA_TSTRING || key_type == LUA_TNUMBER) && is_encodable(e, -1)) {
+                if (!first)
+                    encoder_add_char(e, ',');
+                first = 0;
+
+                // convert a copy: lua_next needs the original key
+                size_t key_len;
+                lua_pushvalue(L, -2);
+                const char *key = lua_tolstring(L, -1, &key_len);
+                encode_string(e, key, key_len);
+                lua_pop(L, 1);
+
+                encoder_add_char(e, ':');
+                encode_value(e, lua_gettop(L), depth + 1);
+            }
+            lua_pop(L, 1);
+        }
+        encoder_add_char(e, '}');
+    }
+}
+
+static void encode_value(encoder_t *e, int idx, int depth) {
+    lua_State *L = e->L;
+    switch (lua_type(L, idx)) {
+        case LUA_TNIL:
+            encoder_add_literal(e, "null");
+            break;
+        case LUA_TBOOLEAN:
+            if (lua_toboolean(L, idx)) {
+                encoder_add_literal(e, "true");
+            } else {
+                encoder_add_literal(e, "false");
+            }
+            break;
+        case LUA_TNUMBER:
+            encode_number(e, lua_tonumber(L, idx));
+            break;
+        case LUA_TSTRING: {
+            size_t len;
+            const char *s = lua_tolstring(L, idx, &len);
+            encode_string(e, s, len);
+            break;
+        }
+        case LUA_TTABLE:
+            encode_table(e, idx, depth);
+            break;
+        default:
+            if (lua_rawequal(L, idx, e->null)) {
+                encoder_add_literal(e, "null");
+                break;
+            }
+            luaL_error(L, "json: cannot encode %s", luaL_typename(L, idx));
+    }
+}
+
+static int json_encode(lua_State *L) {
+    lua_settop(L, 1);
+    lua_pushlightuserdata(L, (void*)&null_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    encoder_t e = {
+        .L = L,
+        .len = 0,
+        .size = 256,
+        .null = 2,
+        .slot = 3,
+    };
+    e.data = lua_newuserdata(L, e.size);
+    encode_value(&e, 1, 0);
+    lua_pushlstring(L, e.data, e.len);
+    return 1;
+}
+
+/*==== Streaming decoder ====*/
+
+/* json.stream(handler [, max_size]) returns an object that accepts
+ * arbitrary chunks of input with stream:feed(chunk) and calls
+ * handler(value) for every complete top level value. Only new bytes
+ * are scanned on each feed, a complete value is decoded exactly once.
+ * Numbers and literals at the top level are complete once the next
+ * byte (like a newline) arrives. */
+
+#define STREAM_MAX_SIZE (1024 * 1024)        // default max_size
+#define STREAM_SIZE_LIMIT (64 * 1024 * 1024)  // largest max_size allowed
+
+enum { VALUE_NONE, VALUE_CONTAINER, VALUE_STRING, VALUE_SCALAR };
+enum { COMMENT_NONE, COMMENT_SLASH, COMMENT_BODY, COMMENT_STAR };
+
+typedef struct {
+    char *buf;       // userdata in the environment of the stream
+    size_t len;      // bytes in buf
+    size_t size;     // allocated size of buf
+    size_t consumed; // bytes of buf that are already handled
+    size_t scanned;  // bytes of buf already seen by the scanner
+    size_t max_size; // maximum size of a pending value
+    int value;       // VALUE_* of the value currently scanned
+    int comment;     // COMMENT_* state
+    int depth;
+    char quote;      // inside a string if non zero
+    int escape;
+} stream_t;
+
+#define STREAM_META "json.stream"
+
+static stream_t *checked_stream(lua_State *L, int idx) {
+    return luaL_checkudata(L, idx, STREAM_META);
+}
+
+static void stream_clear(stream_t *s) {
+    s->len = s->consumed = s->scanned = 0;
+    s->value = VALUE_NONE;
+    s->comment = COMMENT_NONE;
+    s->depth = 0;
+    s->quote = 0;
+    s->escape = 0;
+}
+
+static int is_scalar_char(char c) {
+    return is_number_char(c) || (c >= 'a' && c <= 'z');
+}
+
+/* Scans from s->scanned and returns the end offset of the next
+ * complete value or 0 if more input is needed. */
+static size_t stream_scan(stream_t *s) {
+    while (s->scanned < s->len) {
+        char c = s->buf[s->scanned];
+
+        if (s->comment == COMMENT_BODY || s->comment == COMMENT_STAR) {
+            if (c == '/' && s->comment == COMMENT_STAR) {
+                s->comment = COMMENT_NONE;
+            } else {
+                s->comment = c == '*' ? COMMENT_STAR : COMMENT_BODY;
+            }
+            s->scanned++;
+            continue;
+        }
+        if (s->comment == COMMENT_SLASH) {
+            s->comment = COMMENT_NONE;
+            if (c == '*') {
+                s->comment = COMMENT_BODY;
+                s->scanned++;
+                continue;
+            }
+        }
+
+        if (s->quote) {
+            s->scanned++;
+            if (s->escape) {
+                s->escape = 0;
+            } else if (c == '\\') {
+                s->escape = 1;
+            } else if (c == s->quote) {
+                s->quote = 0;
+                if (s->value == VALUE_STRING)
+                    return s->scanned;
+            }
+            continue;
+        }
+
+        if (s->value == VALUE_SCALAR) {
+            if (!is_scalar_char(c))
+                return s->scanned; // c belongs to whatever follows
+            s->scanned++;
+            continue;
+        }
+
+        if (c == '/') {
+            s->comment = COMMENT_SLASH;
+            s->scanned++;
+            continue;
+        }
+
+        if (s->value == VALUE_NONE) {
+            if (c == ' ' || c == '\n' || c == '\r' || c == '\t') {
+                s->scanned++;
+                s->consumed = s->scanned;
+                continue;
+            }
+            if (c == '{' || c == '[') {
+                s->value = VALUE_CONTAINER;
+            } else if (c == '"' || c == '\'') {
+                s->value = VALUE_STRING;
+            } else {
+                s->value = VALUE_SCALAR;
+            }
+        }
+
+        s->scanned++;
+        if (c == '"' || c == '\'') {
+            s->quote = c;
+        } else if (c == '{' || c == '[') {
+            s->depth++;
+        } else if (c == '}' || c == ']') {
+            if (--s->depth <= 0)
+                return s->scanned;
+        }
+    }
+    return 0;
+}
+
+static int stream_feed(lua_State *L) {
+    stream_t *s = checked_stream(L, 1);
+    size_t chunk_len;
+    const char *chunk = luaL_optlstring(L, 2, "", &chunk_len);
+
+    // Drop everything handled by the previous feed
+    if (s->consumed > 0) {
+        memmove(s->buf, s->buf + s->consumed, s->len - s->consumed);
+        s->len -= s->consumed;
+        s->scanned -= s->consumed;
+        s->consumed = 0;
+    }
+
+    if (s->len + chunk_len > s->size) {
+        size_t size = s->size ? s->size : 256;
+        while (size < s->len + chunk_len)
+            size *= 2;
+        // The buffer is a userdata, so it counts against the
+        // memory limit of the node like everything else.
+        char *buf = lua_newuserdata(L, size);
+        memcpy(buf, s->buf, s->len);
+        lua_getfenv(L, 1);
+        lua_insert(L, -2);
+        lua_rawseti(L, -2, 2);
+        lua_pop(L, 1);
+        s->buf = buf;
+        s->size = size;
+    }
+    memcpy(s->buf + s->len, chunk, chunk_len);
+    s->len += chunk_len;
+
+    lua_getfenv(L, 1);
+    lua_rawgeti(L, -1, 1);
+    int handler = lua_gettop(L);
+
+    int values = 0;
+    size_t end;
+    while ((end = stream_scan(s))) {
+        // Update the state before decoding: Errors raised by the
+        // decoder or the handler must not break the stream.
+        size_t start = s->consumed;
+        s->consumed = end;
+        s->value = VALUE_NONE;
+        s->depth = 0;
+
+        decoder_t d = {
+            .L = L,
+            .start = s->buf + start,
+            .pos = s->buf + start,
+            .end = s->buf + end,
+            .depth = 0,
+        };
+        lua_pushvalue(L, handler);
+        decode_value(&d);
+        skip_whitespace(&d);
+        if (d.pos != d.end)
+            decode_error(&d, "unexpected character");
+        lua_call(L, 1, 0);
+        values++;
+    }
+
+    if (s->len - s->consumed > s->max_size) {
+        stream_clear(s);
+        luaL_error(L, "json: pending value exceeds %d bytes", (int)s->max_size);
+    }
+    lua_pushinteger(L, values);
+    return 1;
+}
+
+static int stream_pending(lua_State *L) {
+    stream_t *s = checked_stream(L, 1);
+    lua_pushinteger(L, s->len - s->consumed);
+    return 1;
+}
+
+static int stream_reset(lua_State *L) {
+    stream_clear(checked_stream(L, 1));
+    return 0;
+}
+
+static const luaL_reg stream_methods[] = {
+    {"feed",    stream_feed},
+    {"pending", stream_pending},
+    {"reset",   stream_reset},
+    {0, 0}
+};
+
+static int json_stream(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    lua_Integer max_size = luaL_optinteger(L, 2, STREAM_MAX_SIZE);
+    luaL_argcheck(L, max_size > 0 && max_size <= STREAM_SIZE_LIMIT, 2,
+        "invalid max_size");
+
+    stream_t *s = lua_newuserdata(L, sizeof(stream_t));
+    memset(s, 0, sizeof(stream_t));
+    s->max_size = max_size;
+    stream_clear(s);
+    luaL_getmetatable(L, STREAM_META);
+    lua_setmetatable(L, -2);
+
+    lua_createtable(L, 2, 0);
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, -2, 1);
+    lua_setfenv(L, -2);
+    return 1;
+}
+
+/*==== json.null ====*/
+
+static int json_null(lua_State *L) {
+    lua_pushlightuserdata(L, (void*)&null_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    return 1;
+}
+
+static const luaL_reg json_methods[] = {
+    {"encode", json_encode},
+    {"decode", json_decode},
+    {"stream", json_stream},
+    {0, 0}
+};
+
+LUALIB_API int luaopen_json(lua_State *L) {
+    luaL_newmetatable(L, STREAM_META);
+    lua_pushliteral(L, "__index");
+    lua_newtable(L);
+    luaL_register(L, NULL, stream_methods);
+    lua_rawset(L, -3);
+    lua_pushliteral(L, "__metatable");
+    lua_pushboolean(L, 0);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+
+    lua_pushlightuserdata(L, (void*)&null_key);
+    lua_pushcfunction(L, json_null);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    luaL_register(L, "json", json_methods);
+    lua_pushliteral(L, "null");
+    json_null(L);
+    lua_rawset(L, -3);
+    return 1;
+}
@@ -0,0 +1,10 @@
+/* See Copyright Notice in LICENSE.txt */
+
+#ifndef JSON_H
+#define JSON_H
+
+#include <lua.h>
+
+LUALIB_API int luaopen_json(lua_State *L);
+
+#endif
@@ -4,12 +4,18 @@ function kprint(msg)
     print("kernel: " .. msg)
 end
 
-function safe_loadstring(code, chunkname, allow_precompiled)
+function safe_loadstring(code, chunkname, allow_precompiled, cached)
     if not allow_precompiled and string.byte(code, 1) == 27 then
         return nil, string.format(
             "precompiled code not allowed for chunk '%s'",
             chunkname
         )
+    elseif cached and type(code) == "string" and type(chunkname) == "string" then
+        -- userlib and node code are loaded again on every
+        -- reload. Use the process wide cache. Nodes choose the
+        -- chunknames passed to their loadstring, so that never
+        -- uses the cache.
+        return load_cached(code, chunkname)
     else
         return loadstring(code, chunkname)
     end
@@ -49,60 +55,21 @@ local N = {}
 local function noop()
 end
 
-function create_sandbox()
-    local native_w, native_h = get_screen_info()
-
-    local sandbox = {
-        error = error;
-        assert = assert;
-        ipairs = ipairs;
-        next = next;
-        pairs = pairs;
-        pcall = pcall;
-        rawequal = rawequal;
-        rawget = rawget;
-        rawset = rawset;
-        select = select;
-        tonumber = tonumber;
-        tostring = tostring;
-        type = type;
-        unpack = unpack;
-        xpcall = xpcall;
-        setmetatable = setmetatable;
-        getmetatable = getmetatable;
-
-        module = function(name, ...)
-            local module = sandbox.package.loaded[name]
-            if not module then
-                module = sandbox._G[name]
-            end
-            if not module then
-                module = {
-                    _NAME = name;
-                    _PACKAGE = name;
-                }
-                module._M = module
-            end
-            -- Make sure setfenv won't change the outer
-            -- environment.
-            if getfenv(2) == _G then
-                error("cannot modify outer environment")
-            end
-            setfenv(2, module)
-            for _, func in ipairs({...}) do
-                module = func(module)
-            end
-            sandbox._G[name] = module
-            sandbox.package.loaded[name] = module
-            return module
-        end;
-
+-- Library tables don't depend on the node code, so they are built
+-- once per state on first use. Each sandbox gets a shallow copy,
+-- so changes like userlib's table.filter are gone on the next
+-- reload, same as before.
+local function create_libraries()
+    return {
         struct = {
             unpack = struct.unpack;
         };
 
-        _BUNDLED_MODULES = {
-            ["json.lua"] = MODULE_JSON;
+        json = {
+            encode = json.encode;
+            decode = json.decode;
+            stream = json.stream;
+            null = json.null;
         };
 
         coroutine = {
@@ -194,21 +161,11 @@ function create_sandbox()
             sort = table.sort;
         };
 
-        print = print;
-
-        loadstring = function(code, chunkname)
-            local func, err = safe_loadstring(code, chunkname, false)
-            if func then
-                return setfenv(func, sandbox)
-            else
-                return nil, err
-            end
-        end;
-
         resource = {
             render_child = render_child;
             load_image = load_image;
             load_image_async = load_image;
+            preload = preload;
             load_video = load_video;
             load_font = load_font;
             load_file = load_file;
@@ -277,6 +234,186 @@ function create_sandbox()
             PLATFORM = "desktop";
             VERSION = VERSION;
         };
+    }
+end
+
+local libraries
+
+local function library(name)
+    if not libraries then
+        libraries = create_libraries()
+    end
+    local copy = {}
+    for k, v in pairs(libraries[name]) do
+        copy[k] = v
+    end
+    return copy
+end
+
+-- Functions placed into every sandbox. They only refer to the
+-- current sandbox through the global 'sandbox', so they don't
+-- have to be recreated on reload.
+local function sandbox_module(name, ...)
+    local module = sandbox.package.loaded[name]
+    if not module then
+        module = sandbox._G[name]
+    end
+    if not module then
+        module = {
+            _NAME = name;
+            _PACKAGE = name;
+        }
+        module._M = module
+    end
+    -- Make sure setfenv won't change the outer
+    -- environment.
+    if getfenv(2) == _G then
+        error("cannot modify outer environment")
+    end
+    setfenv(2, module)
+    for _, func in ipairs({...}) do
+        module = func(module)
+    end
+    sandbox._G[name] = module
+    sandbox.package.loaded[name] = module
+    return module
+end
+
+local function sandbox_loadstring(code, chunkname)
+    local func, err = safe_loadstring(code, chunkname, false)
+    if func then
+        return setfenv(func, sandbox)
+    else
+        return nil, err
+    end
+end
+
+local function on_raw_data(data, is_osc, suffix)
+    if is_osc then
+        if string.byte(data, 1, 1) ~= 44 then
+            kprint("no osc type tag string")
+            return
+        end
+        local typetags, offset = struct.unpack(">!4s", data)
+        local tags = {string.byte(typetags, 1, offset)}
+        local fmt = ">!4"
+        for idx, tag in ipairs(tags) do
+            if tag == 44 then -- ,
+                fmt = fmt .. "s"
+            elseif tag == 105 then -- i
+                fmt = fmt .. "i4"
+            elseif tag == 102 then -- f
+                fmt = fmt .. "f"
+            elseif tag == 98 then -- b
+                kprint("no blob support")
+                return
+            else
+                kprint("unknown type tag " .. string.char(tag))
+                return
+            end
+        end
+        local unpacked = {struct.unpack(fmt, data)}
+        table.remove(unpacked, 1) -- remove typetags
+        table.remove(unpacked, #unpacked) -- remove trailing offset
+        sandbox.node.dispatch("osc", suffix, unpack(unpacked))
+    else
+        sandbox.node.dispatch("data", data, suffix)
+    end
+end
+
+local function on_render()
+    sandbox.node.render()
+end
+
+local function on_update(dt)
+    if sandbox.node.update then
+        sandbox.node.update(dt)
+    end
+end
+
+local function node_event(event, handler)
+    if not sandbox.events[event] then
+        sandbox.events[event] = {}
+    end
+    table.insert(sandbox.events[event], handler)
+    if event == "update" then
+        set_flag("update")
+    end
+end
+
+local function node_dispatch(event, ...)
+    for _, handler in ipairs(sandbox.events[event] or {}) do
+        handler(...)
+    end
+end
+
+local function node_gc()
+    -- Finalizers release GL resources. Collecting
+    -- on a worker thread is not possible.
+    if render_thread() then
+        collectgarbage();
+        collectgarbage();
+    end
+end
+
+-- Only nodes using node.update or the update event
+-- get the per frame update call.
+local node_mt = {
+    __newindex = function(t, k, v)
+        rawset(t, k, v)
+        if k == "update" then
+            set_flag("update")
+        end
+    end
+}
+
+function create_sandbox()
+    local native_w, native_h = get_screen_info()
+
+    local sandbox = {
+        error = error;
+        assert = assert;
+        ipairs = ipairs;
+        next = next;
+        pairs = pairs;
+        pcall = pcall;
+        rawequal = rawequal;
+        rawget = rawget;
+        rawset = rawset;
+        select = select;
+        tonumber = tonumber;
+        tostring = tostring;
+        type = type;
+        unpack = unpack;
+        xpcall = xpcall;
+        setmetatable = setmetatable;
+        getmetatable = getmetatable;
+
+        module = sandbox_module;
+
+        struct = library "struct";
+
+        _BUNDLED_MODULES = {
+            ["json.lua"] = MODULE_JSON;
+        };
+
+        _NATIVE_MODULES = {
+            json = library "json";
+        };
+
+        coroutine = library "coroutine";
+        debug = library "debug";
+        math = library "math";
+        string = library "string";
+        table = library "table";
+
+        print = print;
+
+        loadstring = sandbox_loadstring;
+
+        resource = library "resource";
+        gl = library "gl";
+        sys = library "sys";
 
         events = {
             child_add = {};
@@ -291,76 +428,21 @@ function create_sandbox()
             input = {};
             disconnect = {};
 
-            raw_data = {
-                function(data, is_osc, suffix)
-                    if is_osc then
-                        if string.byte(data, 1, 1) ~= 44 then
-                            kprint("no osc type tag string")
-                            return
-                        end
-                        local typetags, offset = struct.unpack(">!4s", data)
-                        local tags = {string.byte(typetags, 1, offset)}
-                        local fmt = ">!4"
-                        for idx, tag in ipairs(tags) do
-                            if tag == 44 then -- ,
-                                fmt = fmt .. "s"
-                            elseif tag == 105 then -- i
-                                fmt = fmt .. "i4"
-                            elseif tag == 102 then -- f
-                                fmt = fmt .. "f"
-                            elseif tag == 98 then -- b
-                                kprint("no blob support")
-                                return
-                            else
-                                kprint("unknown type tag " .. string.char(tag))
-                                return
-                            end
-                        end
-                        local unpacked = {struct.unpack(fmt, data)}
-                        table.remove(unpacked, 1) -- remove typetags
-                        table.remove(unpacked, #unpacked) -- remove trailing offset
-                        sandbox.node.dispatch("osc", suffix, unpack(unpacked))
-                    else
-                        sandbox.node.dispatch("data", data, suffix)
-                    end
-                end;
-            };
-
-            render = {
-                function()
-                    sandbox.node.render()
-                end
-            };
+            raw_data = { on_raw_data };
+            render = { on_render };
+            update = { on_update };
         };
 
-        node = {
+        node = setmetatable({
             alias = set_alias;
             client_write = client_write;
             reset_error = noop;
-            set_flag = noop;
-
-            event = function(event, handler)
-                if not sandbox.events[event] then
-                    sandbox.events[event] = {}
-                end
-                table.insert(sandbox.events[event], handler)
-            end;
-
-            dispatch = function(event, ...)
-                for _, handler in ipairs(sandbox.events[event] or {}) do
-                    handler(...)
-                end
-            end;
-
-            render = function()
-            end;
-
-            gc = function ()
-                collectgarbage();
-                collectgarbage();
-            end;
-
-        };
+            set_flag = set_flag;
+            event = node_event;
+            dispatch = node_dispatch;
+            render = noop;
+            gc = node_gc;
+        }, node_mt);
 
         NAME = NAME;
         PATH = PATH;
@@ -388,7 +470,7 @@ end
 
 function load_into_sandbox(code, chunkname, allow_precompiled)
     setfenv(
-        assert(safe_loadstring(code, chunkname, allow_precompiled)),
+        assert(safe_loadstring(code, chunkname, allow_precompiled, true)),
         sandbox
     )()
 end
@@ -431,6 +513,9 @@ do
 
     registry.traceback = debug.traceback
 
+    -- Set when the cpu limit was hit
+    local cpu_exceeded = false
+
     registry.execute = function(cmd, ...)
         if cmd == "boot" then
             kprint("booting node")
@@ -465,6 +550,35 @@ do
                     sandbox.node.dispatch("content_remove", name)
                 end
             end
+        elseif cmd == "content_batch" then
+            -- Pairs of name, added. Never includes NODE_CODE_FILE.
+            -- Each file is dispatched in its own protected call, so
+            -- a failing handler doesn't drop the remaining files.
+            -- The first error is raised once all are delivered.
+            local updates = {...}
+            for i = 1, #updates, 2 do
+                CONTENTS[updates[i]] = updates[i+1] and now() or nil
+            end
+            local first_err
+            cpu_exceeded = false
+            for i = 1, #updates, 2 do
+                local event = updates[i+1] and "content_update" or "content_remove"
+                local ok, err = pcall(sandbox.node.dispatch, event, updates[i])
+                if not ok then
+                    if cpu_exceeded then
+                        error(err, 0)
+                    elseif first_err then
+                        print("runtime error: " .. tostring(err))
+                    else
+                        first_err = err
+                    end
+                end
+            end
+            if first_err then
+                error(first_err, 0)
+            end
+        elseif cmd == "update" then
+            sandbox.node.dispatch("update", ...)
         elseif cmd == "render_self" then
             local screen_width, screen_height = ...
             if full_scale then
@@ -479,10 +593,130 @@ do
     end
 
     registry.alarm = function()
+        cpu_exceeded = true
         error("CPU usage too high")
     end
 end
 
+--=============
+-- LuaJIT
+--=============
+
+-- Calling classic C bindings aborts LuaJIT traces. Route the hot
+-- ones through the FFI instead. See fastpath.h.
+local function setup_fastpath()
+    local ffi = require "ffi"
+    ffi.cdef[[
+        const char *fastpath_message(int code);
+        int fastpath_image_draw(void *image, double x1, double y1, double x2, double y2,
+                double alpha, double sx1, double sy1, double sx2, double sy2);
+        int fastpath_video_draw(void *video, double x1, double y1, double x2, double y2,
+                double alpha, double sx1, double sy1, double sx2, double sy2);
+        int fastpath_font_write(void *font, double x, double y, const char *text,
+                double size, double r, double g, double b, double a, double *width);
+        int fastpath_gl_push_matrix(void *node);
+        int fastpath_gl_pop_matrix(void *node);
+        int fastpath_gl_rotate(void *node, double angle, double x, double y, double z);
+        int fastpath_gl_translate(void *node, double x, double y, double z);
+        int fastpath_gl_scale(void *node, double x, double y, double z);
+    ]]
+    local C = ffi.C
+    local node = NODE_HANDLE
+    local width = ffi.new("double[1]")
+
+    -- fails if the binary doesn't export the functions
+    ffi.string(C.fastpath_message(0))
+
+    local function check(ret)
+        if ret ~= 0 then
+            error(ffi.string(C.fastpath_message(ret)), 0)
+        end
+    end
+
+    -- Everything else (numeric strings, missing or invalid
+    -- arguments) goes to the classic binding, so errors are
+    -- reported the same way as without LuaJIT.
+    local function num(v)
+        return type(v) == "number"
+    end
+    local function opt(v)
+        return v == nil or type(v) == "number"
+    end
+
+    -- Only real objects take the fast path. Their metatable
+    -- is protected, so it can't be faked by node code.
+    local image_draw = image.draw
+    image.draw = function(self, x1, y1, x2, y2, alpha, sx1, sy1, sx2, sy2)
+        if type(self) ~= "userdata" or getmetatable(self) ~= image or
+                not (num(x1) and num(y1) and num(x2) and num(y2) and opt(alpha) and
+                     opt(sx1) and opt(sy1) and opt(sx2) and opt(sy2)) then
+            return image_draw(self, x1, y1, x2, y2, alpha, sx1, sy1, sx2, sy2)
+        end
+        check(C.fastpath_image_draw(self, x1, y1, x2, y2, alpha or 1,
+            sx1 or 0, sy1 or 0, sx2 or 1, sy2 or 1
+        ))
+    end
+
+    local video_draw = video.draw
+    video.draw = function(self, x1, y1, x2, y2, alpha, sx1, sy1, sx2, sy2)
+        if type(self) ~= "userdata" or getmetatable(self) ~= video or
+                not (num(x1) and num(y1) and num(x2) and num(y2) and opt(alpha) and
+                     opt(sx1) and opt(sy1) and opt(sx2) and opt(sy2)) then
+            return video_draw(self, x1, y1, x2, y2, alpha, sx1, sy1, sx2, sy2)
+        end
+        check(C.fastpath_video_draw(self, x1, y1, x2, y2, alpha or 1,
+            sx1 or 0, sy1 or 0, sx2 or 1, sy2 or 1
+        ))
+    end
+
+    -- texture like colors still use the classic binding
+    local font_write = font.write
+    font.write = function(self, x, y, text, size, r, g, b, a)
+        if type(self) ~= "userdata" or getmetatable(self) ~= font or
+                type(text) ~= "string" or
+                not (num(x) and num(y) and num(size) and
+                     num(r) and num(g) and num(b) and opt(a)) then
+            return font_write(self, x, y, text, size, r, g, b, a)
+        end
+        check(C.fastpath_font_write(self, x, y, text, size, r, g, b, a or 1, width))
+        return width[0]
+    end
+
+    glPushMatrix = function()
+        check(C.fastpath_gl_push_matrix(node))
+    end
+    glPopMatrix = function()
+        check(C.fastpath_gl_pop_matrix(node))
+    end
+    local gl_rotate, gl_translate, gl_scale = glRotate, glTranslate, glScale
+    glRotate = function(angle, x, y, z)
+        if not (num(angle) and num(x) and num(y) and num(z)) then
+            return gl_rotate(angle, x, y, z)
+        end
+        check(C.fastpath_gl_rotate(node, angle, x, y, z))
+    end
+    glTranslate = function(x, y, z)
+        if not (num(x) and num(y) and opt(z)) then
+            return gl_translate(x, y, z)
+        end
+        check(C.fastpath_gl_translate(node, x, y, z or 0))
+    end
+    glScale = function(x, y, z)
+        if not (num(x) and num(y) and opt(z)) then
+            return gl_scale(x, y, z)
+        end
+        check(C.fastpath_gl_scale(node, x, y, z or 1))
+    end
+end
+
+if jit and jit.status() then
+    local ok, err = pcall(setup_fastpath)
+    if not ok then
+        kprint("LuaJIT fast paths disabled: " .. err)
+    end
+end
+NODE_HANDLE = nil
+
 io = nil
 require = nil
 loadfile = nil
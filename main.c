@@ -11,6 +11,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <time.h>
+#include <math.h>
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -42,6 +43,19 @@
 #include "vnc.h"
 #include "framebuffer.h"
 #include "struct.h"
+#include "json.h"
+#include "headless.h"
+#include "timing.h"
+#include "worker.h"
+#include "stats.h"
+#include "alloc.h"
+#include "fastpath.h"
+#include "codecache.h"
+#include "preload.h"
+#include "texture.h"
+#include "release.h"
+#include "cull.h"
+#include "sync.h"
 
 #include "kernel.h"
 #include "userlib.h"
@@ -57,14 +71,16 @@
 #define INFO_URL "http://info-beamer.org/"
 
 #define NODE_CODE_FILE "node.lua"
+#define NODE_WATCH_MASK (IN_CLOSE_WRITE|IN_CREATE|IN_DELETE|IN_DELETE_SELF|IN_MOVE)
 
 #define ENVIRONMENT_PREFIX "INFOBEAMER_ENV_"
 #define ENVIRONMENT_PREFIX_SIZE (sizeof(ENVIRONMENT_PREFIX)-1)
 
-#define MAX_MEM 2000000 // KB
+#define MAX_MEM 2000000 // KB, default memory limit per node
 #define MAX_GL_PUSH 20 // glPushMatrix depth
 #define MAX_CHILD_RENDERS 20 // maximum childs rendered per node
 #define MAX_SNAPSHOTS 5 // maximum number of snapshots per render
+#define RENDER_SCALE_STEPS 8 // automatically scaled children render at multiples of 1/x of their size
 
 // Default host/port (both udp & tcp)
 #define LISTEN_ADDR  "0.0.0.0"
@@ -78,20 +94,51 @@
 #define MAX_PCALL_TIME  500000 // usec
 #endif
 
+#define WORKER_HOOK_COUNT 10000 // instructions between deadline checks on workers
+
 #define NO_GL_PUSHPOP -1
 
+#define DEFAULT_FPS 60 // frame rate of the fixed clock and fallback refresh rate
+
 #define NODE_INACTIVITY 2.0 // node considered idle after x seconds
+
+#define GC_BUDGET_SHARE 0.5 // share of the time left until the next vsync used for gc
+#define GC_MIN_BUDGET 0.0005 // always spend that much time (s) on gc per frame ...
+#define GC_MAX_BUDGET 0.010  // ... but never more than that
+#define GC_STEP_SIZE 8 // KB, size of a single lua_gc step
+#define GC_MIN_DEBT 0.1 // don't start a cycle for less garbage than that share of the live memory
 #define NODE_CPU_BLACKLIST 60.0 // seconds a node is blacklisted if it exceeds cpu usage
+#define NODE_MEM_BLACKLIST 60.0 // seconds a node is blacklisted if it keeps exceeding its memory limit
+#define NODE_MEM_VIOLATIONS 3 // memory limit violations ...
+#define NODE_MEM_WINDOW 10.0 // ... within x seconds before a node is blacklisted
+#define BOOT_BUDGET 0.010 // time (s) per frame spent booting new nodes
+#define CONTENT_DEBOUNCE 0.1 // deliver file events once there was no new one for x seconds ...
+#define CONTENT_MAX_DELAY 1.0 // ... but no later than x seconds after the first one
+#define CONTENT_BUDGET 0.005 // time (s) per frame spent delivering file events
+#define MAX_CONTENT_BATCH 64 // file events delivered per node and lua call
+#define PRELOAD_BUDGET 0.004 // time (s) per frame spent uploading preloaded images
+#define PRELOAD_NODE_MEM 65536 // KB, decoded images per node waiting for their upload
+#define RELEASE_BUDGET 0.002 // time (s) per frame spent deleting gl objects of collected resources
 
 static int win_w, win_h;
 
 typedef enum { PROFILE_BOOT, PROFILE_UPDATE, PROFILE_EVENT } profiling_bins;
 
+// coalesced file events for a single file
+typedef struct content_update_s {
+    char *name;
+    int added;
+    double first_event; // real time of the first ...
+    double last_event;  // ... and the most recent event
+    UT_hash_handle hh;
+} content_update_t;
+
 typedef struct node_s {
     int wd; // inotify watch descriptor
 
     char *name;   // local node name
     char *path;   // full path (including node name)
+    char *dir;    // resolved directory, used for all file access
     char *alias;  // alias path
 
     lua_State *L;
@@ -117,11 +164,42 @@ typedef struct node_s {
     double profiling[3];
     double last_profile;
     int num_frames;
+    int num_culled;     // draws skipped as they were outside the viewport
     int num_resource_inits;
     int num_allocs;
+    long long total_allocs;
+    alloc_t alloc;
+    int custom_alloc;          // lua state uses alloc (always true without LuaJIT)
+    long long gc_base;         // memory usage after the last completed gc cycle
+    int mem_failed;            // failed allocations already reported
+    int mem_violations;        // recent memory limit violations
+    int mem_exceeded;          // limit exceeded on a worker, handled after the barrier
+    double last_mem_violation;
 
     double last_activity;
     double blacklisted;
+
+    int threaded;       // events may be handled on a worker thread
+    int wants_update;   // node uses the update event
+    int num_queued;     // number of events waiting for a worker
+    int scheduled;      // node is in the list of nodes with queued events
+    double worker_time; // time spent on a worker since the last barrier (ms)
+
+    int boot_queued;    // node is waiting for its initial boot
+
+    content_update_t *content_updates; // file events waiting for delivery
+
+    int staged;                  // not yet reachable by path or alias
+    struct node_s *replacement;  // new version of this node, booting in the background
+
+    texture_owner_t textures;    // texture memory used by this node
+
+    int drawn_frame;    // last frame the rendered node was drawn ...
+    int visible_frame;  // ... and was in or close to the viewport
+    double drawn_width;  // largest size in pixels it was drawn at ...
+    double drawn_height; // ... in that frame
+
+    double render_scale; // framebuffer size relative to width/height while rendering
 } node_t;
 
 static node_t *nodes_by_wd = NULL;
@@ -129,20 +207,56 @@ static node_t *nodes_by_path = NULL;
 static node_t *nodes_by_alias = NULL;
 static node_t root = {0};
 
+// nodes with events queued for the worker threads
+static node_t **scheduled_nodes = NULL;
+static int num_scheduled = 0;
+static int max_scheduled = 0;
+
+// new nodes waiting for their initial boot, parents first
+static node_t **boot_queue = NULL;
+static int boot_queue_pos = 0;
+static int boot_queue_len = 0;
+static int boot_queue_max = 0;
+
+// file events waiting for delivery in all nodes
+static int num_content_updates = 0;
+
+// nodes with a replacement
+static int num_staged = 0;
+
 typedef struct client_s {
     int fd;
     node_t *node;
     struct bufferevent *buf_ev;
+    struct evbuffer *pending; // written on a worker thread, sent after the barrier
 
     struct client_s *next;
     struct client_s *prev;
 } client_t;
 
 static int inotify_fd;
-static double now;
+static double now;          // local frame time, used for all bookkeeping
+static double shared_now;   // frame time shown to lua (sys.now())
 static int running = 1;
 static int listen_port;
 
+static int headless = 0;
+static int frame_count = 0;     // number of frames rendered so far
+static int frame_limit = 0;     // exit after that many frames (0: unlimited)
+static const char *dump_dir;    // write rendered frames into this directory
+
+// Part of the root canvas shown by this instance (INFOBEAMER_TILE)
+static int tile_x, tile_y, tile_w = 0, tile_h;
+static const char *stats_path;  // write benchmark statistics into this file
+
+static double lua_time = 0;     // total time spent in lua (ms)
+static long long lua_allocs = 0; // number of lua allocations of removed nodes
+static long long lua_peak_mem = 0; // sum of peak memory usage of removed nodes
+static int mem_violations = 0;  // number of memory limit violations
+
+static int mem_limit = MAX_MEM;         // default memory limit per node (KB)
+static const char *node_mem_limits;     // per node limits: <path>:<kb>,...
+
 GLuint default_tex; // white default texture
 struct event_base *event_base;
 struct evdns_base *dns_base;
@@ -155,25 +269,21 @@ static void node_printf(node_t *node, const char *fmt, ...);
 static void node_blacklist(node_t *node, double time);
 static void node_remove_alias(node_t *node);
 static void node_reset_quota(node_t *node);
-static int node_render_to_image(lua_State *L, node_t *node);
+static int node_render_to_image(lua_State *L, node_t *node, node_t *source, double scale);
 static void node_init(node_t *node, node_t *parent, const char *path, const char *name);
 static void node_free(node_t *node);
+static void node_unqueue_boot(node_t *node);
+static void node_drop_content_updates(node_t *node);
+static void node_run_queue(node_t *node);
 
 /*======= Lua Sandboxing =======*/
 
-#ifndef USE_LUAJIT
 static void *lua_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
     node_t *node = ud;
     node->num_allocs++;
-    (void)osize;  /* not used */
-    if (nsize == 0) {
-        free(ptr);
-        return NULL;
-    } else {
-        return realloc(ptr, nsize);
-    }
+    node->total_allocs++;
+    return alloc_lua(&node->alloc, ptr, osize, nsize);
 }
-#endif
 
 /* execution time limiting for pcalls */
 static node_t *global_node = NULL;
@@ -220,13 +330,62 @@ static int lua_timed_pcall(node_t *node, int in, int out,
 
     global_node = node;
     timers_expired = 0;
+    node->alloc.enforce++;
     int ret = lua_pcall(node->L, in, out, error_handler_pos);
+    node->alloc.enforce--;
 
     setitimer(ITIMER_VIRTUAL, &old_timer, NULL);
     global_node = old_global_node;
     return ret;
 }
 
+/* Worker threads cannot use the SIGVTALRM timer: It measures
+ * the cpu time of the whole process and signals are only delivered
+ * to the render thread. Check the thread's cpu time from a count
+ * hook instead. */
+static __thread node_t *worker_node = NULL;
+static __thread double worker_deadline;
+static __thread int worker_timers_expired;
+
+static double thread_cpu_time() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static void worker_deadline_check(lua_State *L, lua_Debug *ar) {
+    double cpu_time = thread_cpu_time();
+    if (cpu_time < worker_deadline)
+        return;
+
+    // Already tried to stop it once? Same as on the render thread.
+    if (worker_timers_expired++)
+        die("unstoppable runaway code in %s", worker_node->path);
+
+    fprintf(stderr, RED("[%s]") " timeout\n", worker_node->path);
+    node_blacklist(worker_node, NODE_CPU_BLACKLIST);
+    worker_deadline = cpu_time + MAX_RUNAWAY_TIME;
+
+    lua_pushliteral(L, "alarm");
+    lua_gettable(L, LUA_REGISTRYINDEX);
+    lua_call(L, 0, 0);
+}
+
+static int lua_worker_pcall(node_t *node, int in, int out,
+        int error_handler_pos)
+{
+    worker_node = node;
+    worker_timers_expired = 0;
+    worker_deadline = thread_cpu_time() + MAX_PCALL_TIME / 1000000.0;
+    lua_sethook(node->L, worker_deadline_check, LUA_MASKCOUNT, WORKER_HOOK_COUNT);
+    node->alloc.enforce++;
+    int ret = lua_pcall(node->L, in, out, error_handler_pos);
+    node->alloc.enforce--;
+    lua_sethook(node->L, NULL, 0, 0);
+    worker_node = NULL;
+    return ret;
+}
+
 static int lua_panic(lua_State *L) {
     die("node panic!");
     return 0;
@@ -252,7 +411,67 @@ static const char *lua_safe_dedup_error_message(lua_State *L) {
     return message;
 }
 
+// Render thread only: A full collection runs finalizers, which
+// must not run on a worker.
+static void node_memory_exceeded(node_t *node) {
+    lua_gc(node->L, LUA_GCCOLLECT, 0);
+
+    // Without the allocator, it might have been garbage only
+    if (!node->custom_alloc &&
+            lua_gc(node->L, LUA_GCCOUNT, 0) * 1024LL <= node->alloc.limit)
+        return;
+
+    mem_violations++;
+    node_printf(node, "memory limit of %dkb exceeded\n", (int)(node->alloc.limit / 1024));
+
+    if (now - node->last_mem_violation > NODE_MEM_WINDOW)
+        node->mem_violations = 0;
+    node->last_mem_violation = now;
+    if (++node->mem_violations >= NODE_MEM_VIOLATIONS) {
+        node->mem_violations = 0;
+        node_blacklist(node, NODE_MEM_BLACKLIST);
+    }
+}
+
+// Called after each protected call. The allocator refuses
+// allocations beyond the limit, so lua already raised an error.
+// Without the allocator, the limit is checked afterwards.
+// Workers only flag the node, see node_handle_worker_memory.
+static void node_check_memory(node_t *node) {
+    if (node->custom_alloc) {
+        if (node->alloc.num_failed == node->mem_failed)
+            return;
+        node->mem_failed = node->alloc.num_failed;
+    } else {
+        size_t used = lua_gc(node->L, LUA_GCCOUNT, 0) * 1024LL;
+        if (used > node->alloc.peak)
+            node->alloc.peak = used;
+        if (!node->alloc.limit || used <= node->alloc.limit)
+            return;
+    }
+    if (worker_on_render_thread())
+        node_memory_exceeded(node);
+    else
+        node->mem_exceeded = 1;
+}
+
+// After a worker barrier: handle limits exceeded on the workers
+static void node_handle_worker_memory(node_t *node) {
+    if (!node->mem_exceeded)
+        return;
+    node->mem_exceeded = 0;
+    node_memory_exceeded(node);
+}
+
 static void lua_node_enter(node_t *node, int args, profiling_bins bin) {
+    static int depth = 0;
+    int render_thread = worker_on_render_thread();
+
+    // Handle events still waiting for a worker first, so
+    // the node always sees events in the order they arrived.
+    if (render_thread && node->num_queued)
+        node_run_queue(node);
+
     node_reset_quota(node);
     lua_State *L = node->L;
     lua_pushliteral(L, "execute");              // [args] "execute"
@@ -264,7 +483,18 @@ static void lua_node_enter(node_t *node, int args, profiling_bins bin) {
     lua_insert(L, error_handler_pos);           // traceback execute [args]
     struct timeval before, after;
     gettimeofday(&before, NULL);
-    int status = lua_timed_pcall(node, args, 0, error_handler_pos);
+    int status;
+    if (render_thread) {
+        texture_owner_t *prev_owner = texture_swap_owner(&node->textures);
+        int *prev_counter = cull_swap_counter(&node->num_culled);
+        depth++;
+        status = lua_timed_pcall(node, args, 0, error_handler_pos);
+        depth--;
+        cull_swap_counter(prev_counter);
+        texture_swap_owner(prev_owner);
+    } else {
+        status = lua_worker_pcall(node, args, 0, error_handler_pos);
+    }
     if (status == 0) {
         // success                              // traceback
         lua_remove(L, error_handler_pos);       //
@@ -279,12 +509,106 @@ static void lua_node_enter(node_t *node, int args, profiling_bins bin) {
             node_printf(node, "%s: %s\n", err, message);
         lua_pop(L, 2);                          //
     }
+    node_check_memory(node);
     gettimeofday(&after, NULL);
-    lua_gc(node->L, LUA_GCSTEP, 5);
-    node->profiling[bin] += time_delta(&before, &after);
+    double delta = time_delta(&before, &after);
+    node->profiling[bin] += delta;
+    if (!render_thread)
+        node->worker_time += delta;
+    else if (depth == 0) // don't count nested calls (like render_child) twice
+        lua_time += delta;
     node->last_activity = now;
 }
 
+// Queue the call of registry.execute with the args on the
+// stack. The node handles it within the next worker barrier.
+static void node_queue(node_t *node, int args, profiling_bins bin) {
+    lua_State *L = node->L;
+    lua_createtable(L, args + 1, 0);            // [args] entry
+    lua_insert(L, -1 - args);                   // entry [args]
+    for (int i = args; i >= 1; i--)
+        lua_rawseti(L, -1 - i, i + 1);          // entry
+    lua_pushinteger(L, bin);
+    lua_rawseti(L, -2, 1);
+
+    lua_pushliteral(L, "queue");                // entry "queue"
+    lua_rawget(L, LUA_REGISTRYINDEX);           // entry queue
+    lua_insert(L, -2);                          // queue entry
+    lua_rawseti(L, -2, ++node->num_queued);     // queue
+    lua_pop(L, 1);                              //
+
+    if (!node->scheduled) {
+        if (num_scheduled == max_scheduled) {
+            max_scheduled = max_scheduled ? max_scheduled * 2 : 16;
+            scheduled_nodes = realloc(scheduled_nodes, sizeof(node_t*) * max_scheduled);
+            if (!scheduled_nodes)
+                die("cannot grow scheduled nodes");
+        }
+        scheduled_nodes[num_scheduled++] = node;
+        node->scheduled = 1;
+    }
+}
+
+// Handle all queued events on the calling thread
+static void node_run_queue(node_t *node) {
+    lua_State *L = node->L;
+    int num_queued = node->num_queued;
+    node->num_queued = 0;
+
+    lua_pushliteral(L, "queue");                // "queue"
+    lua_rawget(L, LUA_REGISTRYINDEX);           // queue
+    lua_pushliteral(L, "queue");                // queue "queue"
+    lua_newtable(L);                            // queue "queue" {}
+    lua_rawset(L, LUA_REGISTRYINDEX);           // queue
+
+    for (int i = 1; i <= num_queued; i++) {
+        lua_rawgeti(L, -1, i);                  // queue entry
+        int entry = lua_gettop(L);
+        int args = lua_objlen(L, entry) - 1;
+        lua_rawgeti(L, entry, 1);
+        profiling_bins bin = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        for (int arg = 2; arg <= args + 1; arg++)
+            lua_rawgeti(L, entry, arg);         // queue entry [args]
+        lua_remove(L, entry);                   // queue [args]
+        lua_node_enter(node, args, bin);        // queue
+    }
+    lua_pop(L, 1);                              //
+}
+
+static void node_run_queue_job(void *item) {
+    node_t *node = item;
+    // Finalizers release GL resources, so they must only
+    // run on the render thread.
+    lua_gc(node->L, LUA_GCSTOP, 0);
+    node_run_queue(node);
+    lua_gc(node->L, LUA_GCRESTART, 0);
+}
+
+// Let the workers handle all queued events. The render
+// thread waits until all of them are completed.
+static void node_run_scheduled() {
+    if (!num_scheduled)
+        return;
+
+    worker_run((void**)scheduled_nodes, num_scheduled, node_run_queue_job);
+
+    for (int i = 0; i < num_scheduled; i++) {
+        node_t *node = scheduled_nodes[i];
+        node->scheduled = 0;
+        lua_time += node->worker_time;
+        node->worker_time = 0;
+        node_handle_worker_memory(node);
+
+        client_t *client;
+        DL_FOREACH(node->clients, client) {
+            if (EVBUFFER_LENGTH(client->pending))
+                bufferevent_write_buffer(client->buf_ev, client->pending);
+        }
+    }
+    num_scheduled = 0;
+}
+
 /*======= Lua entry points =======*/
 
 // reinit sandbox, load usercode and user code
@@ -317,10 +641,31 @@ static void node_content_update(node_t *node, const char *name, int added) {
 
         // remove existing node alias
         node_remove_alias(node);
+
+        // the new code has to opt in again
+        node->threaded = 0;
+        node->wants_update = 0;
+
+        // loading the code boots the node
+        node_unqueue_boot(node);
     }
     lua_node_enter(node, 3, PROFILE_UPDATE);
 }
 
+// notify of multiple content updates with a single call
+static void node_content_batch(node_t *node, content_update_t **updates, int num_updates) {
+    if (!lua_checkstack(node->L, 2 * num_updates + 3))
+        die("cannot grow lua stack");
+    lua_pushliteral(node->L, "content_batch");
+    for (int i = 0; i < num_updates; i++) {
+        fprintf(stderr, YELLOW("[%s]")" update %c%s\n", node->path,
+            updates[i]->added ? '+' : '-', updates[i]->name);
+        lua_pushstring(node->L, updates[i]->name);
+        lua_pushboolean(node->L, updates[i]->added);
+    }
+    lua_node_enter(node, 1 + 2 * num_updates, PROFILE_UPDATE);
+}
+
 // event.<event_name>(args...)
 static void node_event(node_t *node, const char *name, int args) {
     lua_pushliteral(node->L, "event"); // [args] "event_name"
@@ -330,6 +675,29 @@ static void node_event(node_t *node, const char *name, int args) {
     lua_node_enter(node, 2 + args, PROFILE_EVENT);
 }
 
+// event.<event_name>(args...), on a worker thread if the node allows it
+static void node_event_threaded(node_t *node, const char *name, int args) {
+    if (!node->threaded || !worker_count()) {
+        node_event(node, name, args);
+        return;
+    }
+    lua_pushliteral(node->L, "event");
+    lua_pushstring(node->L, name);
+    lua_insert(node->L, -2 - args);
+    lua_insert(node->L, -2 - args);
+    node_queue(node, 2 + args, PROFILE_EVENT);
+}
+
+// update(dt) before rendering. Threaded nodes only queue the call.
+static void node_update(node_t *node, double dt, int threaded) {
+    lua_pushliteral(node->L, "update");
+    lua_pushnumber(node->L, dt);
+    if (threaded)
+        node_queue(node, 2, PROFILE_EVENT);
+    else
+        lua_node_enter(node, 2, PROFILE_EVENT);
+}
+
 // render node
 static void node_render_self(node_t *node, int width, int height) {
     lua_pushliteral(node->L, "render_self");
@@ -344,6 +712,56 @@ static void node_render_self(node_t *node, int width, int height) {
 #define node_is_idle(node) (now > (node)->last_activity + NODE_INACTIVITY)
 #define node_is_blacklisted(node) (now < (node)->blacklisted)
 #define node_is_rendering(node) ((node)->gl_matrix_depth != NO_GL_PUSHPOP)
+#define node_is_tiled(node) ((node) == &root && tile_w && node_setup_completed(node))
+
+// Resets the projection matrix. For a tiled root node it scales the
+// tile up to fill the whole framebuffer, so everything outside of it
+// ends up outside the viewport and is clipped.
+static void node_load_projection(node_t *node) {
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    if (!node_is_tiled(node))
+        return;
+    double sx = (double)node->width / tile_w;
+    double sy = (double)node->height / tile_h;
+    double cx = 2.0 * (tile_x + tile_w / 2.0) / node->width - 1;
+    double cy = 1 - 2.0 * (tile_y + tile_h / 2.0) / node->height;
+    glScaled(sx, sy, 1);
+    glTranslated(-cx, -cy, 0);
+}
+
+// Called by image.c when the rendered image of a child node was
+// drawn. A child that ended up completely outside the viewport is
+// not rendered in the next frame.
+void node_image_drawn(void *source, int visible, double width, double height) {
+    node_t *node = source;
+    int frame = texture_frame();
+    if (node->drawn_frame != frame)
+        node->drawn_width = node->drawn_height = 0;
+    node->drawn_frame = frame;
+    if (visible)
+        node->visible_frame = frame;
+    if (width <= 0 || height <= 0) {
+        // unknown (custom shader): assume full size
+        width = node->width, height = node->height;
+    }
+    if (width > node->drawn_width)
+        node->drawn_width = width;
+    if (height > node->drawn_height)
+        node->drawn_height = height;
+}
+
+// Size of the framebuffer the node renders into
+static void node_framebuffer_size(node_t *node, int *width, int *height) {
+    if (node_is_tiled(node)) {
+        *width = tile_w, *height = tile_h;
+    } else if (node_setup_completed(node)) {
+        *width = ceil(node->width * node->render_scale);
+        *height = ceil(node->height * node->render_scale);
+    } else {
+        *width = *height = 1;
+    }
+}
 
 /*===== Lua bindings ======*/
 
@@ -354,6 +772,12 @@ static node_t *get_rendering_node(lua_State *L) {
     return node;
 }
 
+static node_t *get_render_thread_node(lua_State *L) {
+    node_t *node = lua_touserdata(L, lua_upvalueindex(1));
+    require_render_thread(L);
+    return node;
+}
+
 static int luaResetError(lua_State *L) {
     lua_pushliteral(L, "last_error");
     lua_pushnil(L);
@@ -362,8 +786,8 @@ static int luaResetError(lua_State *L) {
 }
 
 static int luaRenderSelf(lua_State *L) {
-    node_t *node = lua_touserdata(L, lua_upvalueindex(1));
-    return node_render_to_image(L, node);
+    node_t *node = get_render_thread_node(L);
+    return node_render_to_image(L, node, NULL, 1);
 }
 
 static int luaRenderChild(lua_State *L) {
@@ -373,11 +797,46 @@ static int luaRenderChild(lua_State *L) {
 
     const char *name = luaL_checkstring(L, 1);
 
+    // {scale = <0..1>} or {scale = "auto"}
+    double scale = 1;
+    int auto_scale = 0;
+    if (lua_istable(L, 2)) {
+        lua_getfield(L, 2, "scale");
+        if (lua_type(L, -1) == LUA_TSTRING && !strcmp(lua_tostring(L, -1), "auto")) {
+            auto_scale = 1;
+        } else if (!lua_isnil(L, -1)) {
+            scale = luaL_checknumber(L, -1);
+            if (scale <= 0 || scale > 1)
+                return luaL_argerror(L, 2, "scale must be within (0,1] or \"auto\"");
+        }
+        lua_pop(L, 1);
+    } else if (!lua_isnoneornil(L, 2)) {
+        return luaL_argerror(L, 2, "options table expected");
+    }
+
     node_t *child;
     HASH_FIND(by_name, node->childs, name, strlen(name), child);
     if (!child)
         return luaL_error(L, "child %s not found", name);
-    return node_render_to_image(L, child);
+
+    // Drawn far outside of the viewport in the previous frame?
+    // Then it's not visible now either. Children close to the
+    // edge are still rendered, as they might scroll into view.
+    int frame = texture_frame();
+    if (child->drawn_frame && child->drawn_frame == frame - 1 &&
+            child->visible_frame != frame - 1) {
+        return image_create(L, 0, 0, 0, 0, child->width, child->height, 1, child);
+    }
+
+    // Render at the size it was drawn at in the previous frame,
+    // rounded up, so small changes don't need a new framebuffer.
+    if (auto_scale && node_setup_completed(child) && child->drawn_frame == frame - 1) {
+        scale = fmax(child->drawn_width / child->width,
+                     child->drawn_height / child->height);
+        scale = CLAMP(ceil(scale * RENDER_SCALE_STEPS) / RENDER_SCALE_STEPS,
+                      1.0 / RENDER_SCALE_STEPS, 1);
+    }
+    return node_render_to_image(L, child, child, scale);
 }
 
 static int luaSetup(lua_State *L) {
@@ -397,13 +856,13 @@ static int luaSetup(lua_State *L) {
 
 static int luaGlOrtho(lua_State *L) {
     node_t *node = get_rendering_node(L);
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
+    node_load_projection(node);
     glOrtho(0, node->width,
             node->height, 0,
             -1000, 1000);
     glMatrixMode(GL_MODELVIEW);
     glLoadIdentity();
+    cull_reset();
     node->gl_matrix_depth = 0;
     return 0;
 }
@@ -417,22 +876,29 @@ static int luaGlPerspective(lua_State *L) {
     double center_x = luaL_checknumber(L, 5);
     double center_y = luaL_checknumber(L, 6);
     double center_z = luaL_checknumber(L, 7);
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
+    node_load_projection(node);
     gluPerspective(fov, (float)node->width / (float)node->height, 0.1, 10000);
     gluLookAt(eye_x, eye_y, eye_z, 
               center_x, center_y, center_z,
               0, -1, 0);
     glMatrixMode(GL_MODELVIEW);
     glLoadIdentity();
+    cull_reset();
     node->gl_matrix_depth = 0;
     return 0;
 }
 
 static int luaSetAlias(lua_State *L) {
-    node_t *node = lua_touserdata(L, lua_upvalueindex(1));
+    node_t *node = get_render_thread_node(L);
     const char *alias = luaL_checkstring(L, 1);
 
+    // registered once the node is swapped in
+    if (node->staged) {
+        free(node->alias);
+        node->alias = strdup(alias);
+        return 0;
+    }
+
     // already exists?
     node_t *existing_node;
     HASH_FIND(by_alias, nodes_by_alias, alias, strlen(alias), existing_node);
@@ -457,34 +923,47 @@ static int luaSetAlias(lua_State *L) {
 }
 
 static int luaLoadImage(lua_State *L) {
-    node_t *node = lua_touserdata(L, lua_upvalueindex(1));
+    node_t *node = get_render_thread_node(L);
     const char *name = luaL_checkstring(L, 1);
     if (index(name, '/'))
         luaL_argerror(L, 1, "invalid resource name");
     char path[PATH_MAX];
-    snprintf(path, sizeof(path), "%s/%s", node->path, name);
+    snprintf(path, sizeof(path), "%s/%s", node->dir, name);
     node->num_resource_inits++;
     return image_load(L, path, name);
 }
 
+static int luaPreload(lua_State *L) {
+    node_t *node = get_render_thread_node(L);
+    const char *name = luaL_checkstring(L, 1);
+    int priority = luaL_optnumber(L, 2, 0);
+    if (index(name, '/'))
+        luaL_argerror(L, 1, "invalid resource name");
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", node->dir, name);
+    node->num_resource_inits++;
+    return image_preload(L, path, priority);
+}
+
 static int luaLoadVideo(lua_State *L) {
-    node_t *node = lua_touserdata(L, lua_upvalueindex(1));
+    node_t *node = get_render_thread_node(L);
     const char *name = luaL_checkstring(L, 1);
     if (index(name, '/'))
         luaL_argerror(L, 1, "invalid resource name");
     char path[PATH_MAX];
-    snprintf(path, sizeof(path), "%s/%s", node->path, name);
+    snprintf(path, sizeof(path), "%s/%s", node->dir, name);
+    int shared = lua_toboolean(L, 2);
     node->num_resource_inits++;
-    return video_load(L, path, name);
+    return video_load(L, path, name, shared);
 }
 
 static int luaLoadFont(lua_State *L) {
-    node_t *node = lua_touserdata(L, lua_upvalueindex(1));
+    node_t *node = get_render_thread_node(L);
     const char *name = luaL_checkstring(L, 1);
     if (index(name, '/'))
         luaL_argerror(L, 1, "invalid resource name");
     char path[PATH_MAX];
-    snprintf(path, sizeof(path), "%s/%s", node->path, name);
+    snprintf(path, sizeof(path), "%s/%s", node->dir, name);
     node->num_resource_inits++;
     return font_new(L, path, name);
 }
@@ -495,7 +974,7 @@ static int luaLoadFile(lua_State *L) {
     if (index(name, '/'))
         luaL_argerror(L, 1, "invalid resource name");
     char path[PATH_MAX];
-    snprintf(path, sizeof(path), "%s/%s", node->path, name);
+    snprintf(path, sizeof(path), "%s/%s", node->dir, name);
 
     int fd = open(path, O_RDONLY);
     if (fd == -1)
@@ -519,7 +998,7 @@ static int luaLoadFile(lua_State *L) {
 }
 
 static int luaCreateColoredTexture(lua_State *L) {
-    node_t *node = lua_touserdata(L, lua_upvalueindex(1));
+    node_t *node = get_render_thread_node(L);
     GLfloat r = luaL_checknumber(L, 1);
     GLfloat g = luaL_checknumber(L, 2);
     GLfloat b = luaL_checknumber(L, 3);
@@ -541,8 +1020,10 @@ static int luaCreateSnapshot(lua_State *L) {
     int mipmap = 0;
     int x = 0;
     int y = 0;
-    int width = node->width;
-    int height = node->height;
+    int fb_width, fb_height;
+    node_framebuffer_size(node, &fb_width, &fb_height);
+    int width = fb_width;
+    int height = fb_height;
     if (lua_gettop(L) <= 1) {
         mipmap = lua_toboolean(L, 1);
     } else if (lua_gettop(L) == 4) {
@@ -550,20 +1031,28 @@ static int luaCreateSnapshot(lua_State *L) {
         y = luaL_checknumber(L, 2);
         width = luaL_checknumber(L, 3);
         height = luaL_checknumber(L, 4);
+        if (node_is_tiled(node)) {
+            x -= tile_x, y -= tile_y;
+        } else if (node->render_scale != 1) {
+            x = floor(x * node->render_scale);
+            y = floor(y * node->render_scale);
+            width = ceil(width * node->render_scale);
+            height = ceil(height * node->render_scale);
+        }
         if (x < 0 || y < 0 || width < 0 || height < 0 ||
-            x + width > node->width || y + height > node->height) {
+            x + width > fb_width || y + height > fb_height) {
             return luaL_error(L, "snapshot out of bounds");
         }
     } else {
         return luaL_error(L, "invalid number of arguments");
     }
     return image_from_current_framebuffer(
-        L, x, node->height - y - height, width, height, mipmap
+        L, x, fb_height - y - height, width, height, mipmap
     );
 }
 
 static int luaCreateShader(lua_State *L) {
-    node_t *node = lua_touserdata(L, lua_upvalueindex(1));
+    node_t *node = get_render_thread_node(L);
     const char *vertex = luaL_checkstring(L, 1);
     const char *fragment = luaL_checkstring(L, 2);
     node->num_resource_inits++;
@@ -571,7 +1060,7 @@ static int luaCreateShader(lua_State *L) {
 }
 
 static int luaCreateVnc(lua_State *L) {
-    node_t *node = lua_touserdata(L, lua_upvalueindex(1));
+    node_t *node = get_render_thread_node(L);
     const char *host = luaL_checkstring(L, 1);
     int port = luaL_optnumber(L, 2, 5900);
     node->num_resource_inits++;
@@ -605,6 +1094,23 @@ static int luaPrint(lua_State *L) {
     return 0;
 }
 
+static int luaSetFlag(lua_State *L) {
+    node_t *node = lua_touserdata(L, lua_upvalueindex(1));
+    const char *flag = luaL_checkstring(L, 1);
+    int value = lua_isnoneornil(L, 2) ? 1 : lua_toboolean(L, 2);
+    if (!strcmp(flag, "threaded"))
+        node->threaded = value;
+    else if (!strcmp(flag, "update"))
+        node->wants_update = value;
+    // unknown flags are ignored
+    return 0;
+}
+
+static int luaRenderThread(lua_State *L) {
+    lua_pushboolean(L, worker_on_render_thread());
+    return 1;
+}
+
 static int luaGetScreenInfo(lua_State *L) {
     lua_pushnumber(L, win_w);
     lua_pushnumber(L, win_h);
@@ -624,7 +1130,10 @@ static int luaClientWrite(lua_State *L) {
     client_t *current_client;
     DL_FOREACH(node->clients, current_client) {
         if (current_client == client) {
-            client_write(current_client, string, string_len);
+            if (worker_on_render_thread())
+                client_write(current_client, string, string_len);
+            else
+                evbuffer_add(current_client->pending, string, string_len);
         }
     }
     return 0;
@@ -638,72 +1147,116 @@ static int luaGlClear(lua_State *L) {
     GLdouble a = luaL_checknumber(L, 4);
     glClearColor(r, g, b, a);
     glClear(GL_COLOR_BUFFER_BIT);
-    glUseProgram(0);
+    shader_use_program(0);
     return 0;
 }
 
-static int luaGlPushMatrix(lua_State *L) {
-    node_t *node = get_rendering_node(L);
+int fastpath_gl_push_matrix(void *obj) {
+    node_t *node = obj;
+    if (!node_is_rendering(node))
+        return FASTPATH_NOT_RENDERING;
     if (node->gl_matrix_depth > MAX_GL_PUSH)
-        return luaL_error(L, "Too may pushes");
+        return FASTPATH_TOO_MANY_PUSHES;
     glPushMatrix();
+    cull_push();
     node->gl_matrix_depth++;
-    return 0;
+    return FASTPATH_OK;
 }
 
-static int luaGlPopMatrix(lua_State *L) {
-    node_t *node = get_rendering_node(L);
+int fastpath_gl_pop_matrix(void *obj) {
+    node_t *node = obj;
+    if (!node_is_rendering(node))
+        return FASTPATH_NOT_RENDERING;
     if (node->gl_matrix_depth == 0)
-        return luaL_error(L, "Nothing to pop");
+        return FASTPATH_NOTHING_TO_POP;
     glPopMatrix();
+    cull_pop();
     node->gl_matrix_depth--;
-    return 0;
+    return FASTPATH_OK;
+}
+
+int fastpath_gl_rotate(void *obj, double angle, double x, double y, double z) {
+    if (!node_is_rendering((node_t*)obj))
+        return FASTPATH_NOT_RENDERING;
+    glRotated(angle, x, y, z);
+    cull_rotate(angle, x, y, z);
+    return FASTPATH_OK;
+}
+
+int fastpath_gl_translate(void *obj, double x, double y, double z) {
+    if (!node_is_rendering((node_t*)obj))
+        return FASTPATH_NOT_RENDERING;
+    glTranslated(x, y, z);
+    cull_translate(x, y, z);
+    return FASTPATH_OK;
+}
+
+int fastpath_gl_scale(void *obj, double x, double y, double z) {
+    if (!node_is_rendering((node_t*)obj))
+        return FASTPATH_NOT_RENDERING;
+    glScaled(x, y, z);
+    cull_scale(x, y, z);
+    return FASTPATH_OK;
+}
+
+#define fastpath_call(L, call) \
+    do { \
+        int ret = call; \
+        if (ret != FASTPATH_OK) \
+            return fastpath_error(L, ret); \
+        return 0; \
+    } while (0)
+
+static int luaGlPushMatrix(lua_State *L) {
+    node_t *node = lua_touserdata(L, lua_upvalueindex(1));
+    fastpath_call(L, fastpath_gl_push_matrix(node));
+}
+
+static int luaGlPopMatrix(lua_State *L) {
+    node_t *node = lua_touserdata(L, lua_upvalueindex(1));
+    fastpath_call(L, fastpath_gl_pop_matrix(node));
 }
 
 static int luaGlRotate(lua_State *L) {
-    get_rendering_node(L);
+    node_t *node = get_rendering_node(L);
     double angle = luaL_checknumber(L, 1);
     double x = luaL_checknumber(L, 2);
     double y = luaL_checknumber(L, 3);
     double z = luaL_checknumber(L, 4);
-    glRotated(angle, x, y, z);
-    return 0;
+    fastpath_call(L, fastpath_gl_rotate(node, angle, x, y, z));
 }
 
 static int luaGlTranslate(lua_State *L) {
-    get_rendering_node(L);
+    node_t *node = get_rendering_node(L);
     double x = luaL_checknumber(L, 1);
     double y = luaL_checknumber(L, 2);
     double z = luaL_optnumber(L, 3, 0.0);
-    glTranslated(x, y, z);
-    return 0;
+    fastpath_call(L, fastpath_gl_translate(node, x, y, z));
 }
 
 static int luaGlScale(lua_State *L) {
-    get_rendering_node(L);
+    node_t *node = get_rendering_node(L);
     double x = luaL_checknumber(L, 1);
     double y = luaL_checknumber(L, 2);
     double z = luaL_optnumber(L, 3, 1.0);
-    glScaled(x, y, z);
-    return 0;
+    fastpath_call(L, fastpath_gl_scale(node, x, y, z));
 }
 
 static int luaNow(lua_State *L) {
-    lua_pushnumber(L, now);
+    lua_pushnumber(L, shared_now);
     return 1;
 }
 
 /*==== Node functions =====*/
 
-static int node_render_to_image(lua_State *L, node_t *node) {
+// scale is the framebuffer size relative to the node size
+static int node_render_to_image(lua_State *L, node_t *node, node_t *source, double scale) {
     // save current gl state
-    int prev_fbo, prev_prog;
-    GLdouble prev_projection[16];
-    GLdouble prev_modelview[16];
+    int prev_fbo;
     glGetIntegerv(GL_FRAMEBUFFER_BINDING, &prev_fbo);
-    glGetIntegerv(GL_CURRENT_PROGRAM, &prev_prog);
-    glGetDoublev(GL_PROJECTION_MATRIX, prev_projection);
-    glGetDoublev(GL_MODELVIEW_MATRIX, prev_modelview);
+    GLuint prev_prog = shader_current_program();
+    cull_state_t prev_state;
+    cull_save(&prev_state);
 
     glPushAttrib(GL_ALL_ATTRIB_BITS);
 
@@ -711,23 +1264,27 @@ static int node_render_to_image(lua_State *L, node_t *node) {
     if (node_setup_completed(node))
         width = node->width, height = node->height;
 
+    node->render_scale = scale;
+    int fb_width, fb_height;
+    node_framebuffer_size(node, &fb_width, &fb_height);
+
     // get new framebuffer and associated texture from recycler
     unsigned int fbo, tex;
-    make_framebuffer(width, height, &tex, &fbo);
+    make_framebuffer(fb_width, fb_height, &tex, &fbo);
 
     // initialize gl state
-    glUseProgram(0);
+    shader_use_program(0);
 
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
+    node_load_projection(node);
 
-    glViewport(0, 0, width, height);
+    glViewport(0, 0, fb_width, fb_height);
     glOrtho(0, width,
             height, 0,
             -1000, 1000);
 
     glMatrixMode(GL_MODELVIEW);
     glLoadIdentity();
+    cull_reset();
 
     if (!node_setup_completed(node)) {
         node_printf(node, "node not initialized with gl.setup()\n");
@@ -746,10 +1303,13 @@ static int node_render_to_image(lua_State *L, node_t *node) {
         node->gl_matrix_depth = 0;
 
         node->num_frames++;
+        texture_owner_drawn(&node->textures);
         node_event(node, "render", 0);
 
-        while (node->gl_matrix_depth-- > 0)
+        while (node->gl_matrix_depth-- > 0) {
             glPopMatrix();
+            cull_pop();
+        }
         node->gl_matrix_depth = NO_GL_PUSHPOP;
     }
 
@@ -761,13 +1321,20 @@ static int node_render_to_image(lua_State *L, node_t *node) {
     glPopAttrib();
 
     glMatrixMode(GL_PROJECTION);
-    glLoadMatrixd(prev_projection);
+    glLoadMatrixd(prev_state.projection);
     glMatrixMode(GL_MODELVIEW);
-    glLoadMatrixd(prev_modelview);
-    glUseProgram(prev_prog);
+    glLoadMatrixd(prev_state.modelview);
+    cull_restore(&prev_state);
+    shader_use_program(prev_prog);
     glBindFramebuffer(GL_FRAMEBUFFER, prev_fbo);
 
-    return image_create(L, tex, fbo, width, height, 1);
+    // A child rendered scaled down still reports its own size, so
+    // drawing it at image:size() covers the same area as unscaled.
+    if (scale < 1)
+        return image_create(L, tex, fbo, fb_width, fb_height,
+            node->width, node->height, 1, source);
+    return image_create(L, tex, fbo, fb_width, fb_height,
+        fb_width, fb_height, 1, source);
 }
 
 static void node_printf(node_t *node, const char *fmt, ...) {
@@ -786,18 +1353,20 @@ static void node_blacklist(node_t *node, double time) {
 
 static void node_remove_alias(node_t *node) {
     if (node->alias) {
-        HASH_DELETE(by_alias, nodes_by_alias, node);
+        if (!node->staged)
+            HASH_DELETE(by_alias, nodes_by_alias, node);
         free(node->alias);
         node->alias = NULL;
     }
 }
 
-static void node_tree_gc(node_t *node) {
-    if (!node_is_idle(node))
-        lua_gc(node->L, LUA_GCSTEP, 30);
-    node_t *child, *tmp; 
+static void node_tree_update(node_t *node, double dt, int threaded) {
+    if (node->wants_update && !node_is_blacklisted(node) &&
+            (node->threaded && worker_count()) == threaded)
+        node_update(node, dt, threaded);
+    node_t *child, *tmp;
     HASH_ITER(by_name, node->childs, child, tmp) {
-        node_tree_gc(child);
+        node_tree_update(child, dt, threaded);
     };
 }
 
@@ -830,12 +1399,44 @@ static void node_reset_quota(node_t *node) {
     node->snapshot_quota = MAX_SNAPSHOTS;
 }
 
+// Bytes used by the node's lua state
+static long long node_mem(node_t *node) {
+    if (node->custom_alloc)
+        return node->alloc.used;
+    return lua_gc(node->L, LUA_GCCOUNT, 0) * 1024LL;
+}
+
+// Without the allocator, this only includes the
+// usage seen after protected calls.
+static long long node_peak_mem(node_t *node) {
+    return node->alloc.peak;
+}
+
+// Limit from INFOBEAMER_NODE_MEM_LIMITS or the default limit
+static int node_mem_limit(const char *path) {
+    int limit = mem_limit;
+    size_t path_len = strlen(path);
+    const char *pos = node_mem_limits;
+    while (pos && *pos) {
+        const char *sep = strchr(pos, ':');
+        if (!sep)
+            die("invalid INFOBEAMER_NODE_MEM_LIMITS value. use <path>:<kb>,...");
+        if ((size_t)(sep - pos) == path_len && !strncmp(pos, path, path_len))
+            limit = atoi(sep + 1);
+        pos = strchr(sep, ',');
+        if (pos)
+            pos++;
+    }
+    return limit;
+}
+
 static void node_reset_profiler(node_t *node) {
     node->last_profile = now;
     node->profiling[PROFILE_BOOT] = 0.0;
     node->profiling[PROFILE_UPDATE] = 0.0;
     node->profiling[PROFILE_EVENT] = 0.0;
     node->num_frames = 0;
+    node->num_culled = 0;
     node->num_resource_inits = 0;
     node->num_allocs = 0;
 }
@@ -847,12 +1448,22 @@ static void node_reset_profiler(node_t *node) {
      lua_settable((node)->L, LUA_GLOBALSINDEX))
 
 static void node_init(node_t *node, node_t *parent, const char *path, const char *name) {
+    // Files are accessed through the resolved directory, so the
+    // active version of a node keeps using its own files while a
+    // symlink on its path already points to a new version.
+    char dir[PATH_MAX];
+    if (parent)
+        snprintf(dir, sizeof(dir), "%s/%s", parent->dir, name);
+    else
+        snprintf(dir, sizeof(dir), "%s", path);
+    node->dir = realpath(dir, NULL);
+    if (!node->dir)
+        die("cannot resolve directory %s: %s", dir, strerror(errno));
+
     // add directory watcher
-    node->wd = inotify_add_watch(inotify_fd, path, 
-        IN_CLOSE_WRITE|IN_CREATE|IN_DELETE|IN_DELETE_SELF|
-        IN_MOVE);
+    node->wd = inotify_add_watch(inotify_fd, node->dir, NODE_WATCH_MASK);
     if (node->wd == -1)
-        die("cannot start watching directory %s: %s", path, strerror(errno));
+        die("cannot start watching directory %s: %s", node->dir, strerror(errno));
 
     node->parent = parent;
     node->path = strdup(path);
@@ -867,21 +1478,64 @@ static void node_init(node_t *node, node_t *parent, const char *path, const char
 
     node->gl_matrix_depth = NO_GL_PUSHPOP;
 
-    // link by watch descriptor & path
+    // link by watch descriptor & path. Staged nodes are
+    // linked by path once they are swapped in.
+    if (parent && parent->staged)
+        node->staged = 1;
     HASH_ADD(by_wd, nodes_by_wd, wd, sizeof(int), node);
-    HASH_ADD_KEYPTR(by_path, nodes_by_path, node->path, strlen(node->path), node);
+    if (!node->staged)
+        HASH_ADD_KEYPTR(by_path, nodes_by_path, node->path, strlen(node->path), node);
+}
+
+#ifdef USE_LUAJIT
+static int luajit_custom_alloc = 0;
+
+static void *probe_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+    if (nsize == 0) {
+        free(ptr);
+        return NULL;
+    }
+    return realloc(ptr, nsize);
+}
+
+// Custom allocators only work with GC64 builds of LuaJIT. Checked
+// once in main() before node states are created on the workers.
+static void luajit_probe_alloc() {
+    lua_State *L = lua_newstate(probe_alloc, NULL);
+    luajit_custom_alloc = L != NULL;
+    if (L)
+        lua_close(L);
+    else
+        fprintf(stderr, INFO("using the LuaJIT allocator. memory limits are checked after each call\n"));
+}
+#endif
 
-    // create lua state
+// Create the lua state and load the kernel. Only touches
+// the node itself, so it can run on a worker thread.
+static void node_init_lua(node_t *node) {
+    // The memory limit only applies inside of protected calls:
+    // Running out of memory anywhere else would panic.
+    alloc_init(&node->alloc, node_mem_limit(node->path) * 1024LL);
+    node->mem_failed = 0;
+    node->mem_violations = 0;
+    node->mem_exceeded = 0;
 #ifdef USE_LUAJIT
-    node->L = luaL_newstate();
+    node->custom_alloc = luajit_custom_alloc;
+    node->L = luajit_custom_alloc ? lua_newstate(lua_alloc, node) : luaL_newstate();
 #else
     node->L = lua_newstate(lua_alloc, node);
+    node->custom_alloc = 1;
 #endif
 
     if (!node->L)
         die("cannot create lua");
 
     lua_atpanic(node->L, lua_panic);
+
+    lua_pushliteral(node->L, "queue");
+    lua_newtable(node->L);
+    lua_rawset(node->L, LUA_REGISTRYINDEX);
+
     luaL_openlibs(node->L);
     image_register(node->L);
     video_register(node->L);
@@ -889,12 +1543,15 @@ static void node_init(node_t *node, node_t *parent, const char *path, const char
     shader_register(node->L);
     vnc_register(node->L);
     luaopen_struct(node->L);
+    luaopen_json(node->L);
+    luaopen_codecache(node->L);
 
     lua_register_node_func(node, "reset_error", luaResetError);
 
     lua_register_node_func(node, "setup", luaSetup);
     lua_register_node_func(node, "print", luaPrint);
     lua_register_node_func(node, "set_alias", luaSetAlias);
+    lua_register_node_func(node, "set_flag", luaSetFlag);
 
     lua_register_node_func(node, "client_write", luaClientWrite);
 
@@ -903,6 +1560,7 @@ static void node_init(node_t *node, node_t *parent, const char *path, const char
     lua_register_node_func(node, "render_self", luaRenderSelf);
     lua_register_node_func(node, "render_child", luaRenderChild);
     lua_register_node_func(node, "load_image", luaLoadImage);
+    lua_register_node_func(node, "preload", luaPreload);
     lua_register_node_func(node, "load_video", luaLoadVideo);
     lua_register_node_func(node, "load_font", luaLoadFont);
     lua_register_node_func(node, "load_file", luaLoadFile);
@@ -921,14 +1579,15 @@ static void node_init(node_t *node, node_t *parent, const char *path, const char
     lua_register_node_func(node, "glPerspective", luaGlPerspective);
 
     lua_register(node->L, "now", luaNow);
+    lua_register(node->L, "render_thread", luaRenderThread);
 
     lua_pushliteral(node->L, VERSION);
     lua_setglobal(node->L, "VERSION");
 
-    lua_pushstring(node->L, path);
+    lua_pushstring(node->L, node->path);
     lua_setglobal(node->L, "PATH");
 
-    lua_pushstring(node->L, name);
+    lua_pushstring(node->L, node->name);
     lua_setglobal(node->L, "NAME");
 
     lua_pushlstring(node->L, userlib, userlib_size);
@@ -940,6 +1599,10 @@ static void node_init(node_t *node, node_t *parent, const char *path, const char
     lua_pushliteral(node->L, NODE_CODE_FILE);
     lua_setglobal(node->L, "NODE_CODE_FILE");
 
+    // for the LuaJIT fast paths, see fastpath.h
+    lua_pushlightuserdata(node->L, node);
+    lua_setglobal(node->L, "NODE_HANDLE");
+
     // get variables from environment
     lua_newtable(node->L);
     for (const char **cur = (const char**)environ; *cur; cur++) {
@@ -962,7 +1625,7 @@ static void node_init(node_t *node, node_t *parent, const char *path, const char
     lua_setglobal(node->L, "NODE_ENVIRON");
 
 
-    if (luaL_loadbuffer(node->L, kernel, kernel_size, "=kernel.lua") != 0) {
+    if (codecache_load(node->L, kernel, kernel_size, "=kernel.lua") != 0) {
         const char *error =  lua_tostring(node->L, -1);
         // If kernel.lua was procompiled with an incompatible lua
         // version, loading the embedded code fail here. Try to
@@ -975,14 +1638,35 @@ static void node_init(node_t *node, node_t *parent, const char *path, const char
         die("kernel run %s", lua_tostring(node->L, -1));
 }
 
+static void node_drop_replacement(node_t *node) {
+    if (!node->replacement)
+        return;
+    node_free(node->replacement);
+    free(node->replacement);
+    node->replacement = NULL;
+    num_staged--;
+}
+
 static void node_free(node_t *node) {
+    node_drop_replacement(node);
     node_t *child, *tmp; 
     HASH_ITER(by_name, node->childs, child, tmp) {
         node_remove_child(node, child);
     }
     HASH_DELETE(by_wd, nodes_by_wd, node);
-    HASH_DELETE(by_path, nodes_by_path, node);
+    if (!node->staged)
+        HASH_DELETE(by_path, nodes_by_path, node);
+
+    // Another node might watch the same directory
+    node_t *same_wd;
+    HASH_FIND(by_wd, nodes_by_wd, &node->wd, sizeof(int), same_wd);
+    if (!same_wd)
+        inotify_rm_watch(inotify_fd, node->wd);
+
+    node_unqueue_boot(node);
+    node_drop_content_updates(node);
     free(node->path);
+    free(node->dir);
     free(node->name);
 
     node_remove_alias(node);
@@ -994,12 +1678,93 @@ static void node_free(node_t *node) {
     assert(node->clients == NULL);
 
     lua_close(node->L);
+    alloc_destroy(&node->alloc);
+    lua_allocs += node->total_allocs;
+    lua_peak_mem += node_peak_mem(node);
+}
+
+/*======= Node tree initialization =======*/
+
+typedef struct {
+    node_t *node;
+    char **dirs;    // child directories found by node_scan_job
+    int num_dirs;
+    int max_dirs;
+} node_scan_t;
+
+static void node_queue_boot(node_t *node) {
+    if (boot_queue_len == boot_queue_max) {
+        boot_queue_max = boot_queue_max ? boot_queue_max * 2 : 16;
+        boot_queue = realloc(boot_queue, sizeof(node_t*) * boot_queue_max);
+        if (!boot_queue)
+            die("cannot grow boot queue");
+    }
+    boot_queue[boot_queue_len++] = node;
+    node->boot_queued = 1;
+}
+
+static void node_unqueue_boot(node_t *node) {
+    if (!node->boot_queued)
+        return;
+    for (int i = boot_queue_pos; i < boot_queue_len; i++) {
+        if (boot_queue[i] == node)
+            boot_queue[i] = NULL;
+    }
+    node->boot_queued = 0;
+}
+
+// Boot queued nodes until the deadline has passed. Boots at
+// least one node per call, so slow nodes can't stall booting.
+static void node_boot_queued(double deadline) {
+    while (boot_queue_pos < boot_queue_len) {
+        node_t *node = boot_queue[boot_queue_pos++];
+        if (!node)
+            continue;
+        node->boot_queued = 0;
+        node_boot(node);
+        if (timing_real() >= deadline)
+            break;
+    }
+    if (boot_queue_pos == boot_queue_len)
+        boot_queue_pos = boot_queue_len = 0;
+}
+
+// Compile node.lua into the code cache, so booting
+// on the render thread doesn't have to.
+static void node_precompile(node_t *node) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", node->dir, NODE_CODE_FILE);
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return;
+
+    struct stat sb;
+    if (fstat(fd, &sb) == 0 && sb.st_size > 0) {
+        char *code = xmalloc(sb.st_size);
+        if (read(fd, code, sb.st_size) == sb.st_size) {
+            char chunkname[PATH_MAX + 1];
+            snprintf(chunkname, sizeof(chunkname), "=%s", path);
+            codecache_load(node->L, code, sb.st_size, chunkname);
+            lua_pop(node->L, 1); // function or error message
+        }
+        free(code);
+    }
+    close(fd);
 }
 
-static void node_search_and_boot(node_t *node) {
-    DIR *dp = opendir(node->path);
+// Everything needed before a node can boot, except for the
+// parts that have to run on the render thread (adding child
+// nodes and watches). Runs on a worker if there are any.
+static void node_scan_job(void *item) {
+    node_scan_t *scan = item;
+    node_t *node = scan->node;
+
+    node_init_lua(node);
+
+    DIR *dp = opendir(node->dir);
     if (!dp)
-        die("cannot open directory %s: %s", node->path, strerror(errno));
+        die("cannot open directory %s: %s", node->dir, strerror(errno));
 
     struct dirent *ep;
     while ((ep = readdir(dp))) {
@@ -1008,15 +1773,17 @@ static void node_search_and_boot(node_t *node) {
 
         const char *child_name = ep->d_name;
         char child_path[PATH_MAX];
-        snprintf(child_path, sizeof(child_path), "%s/%s", node->path, child_name);
+        snprintf(child_path, sizeof(child_path), "%s/%s", node->dir, child_name);
 
         enum { CHILD_FILE, CHILD_DIR, CHILD_UNKNOWN } type = CHILD_UNKNOWN;
 
-        if (ep->d_type == DT_UNKNOWN) {
+        if (ep->d_type == DT_UNKNOWN || ep->d_type == DT_LNK) {
+           // symlinks are followed. dangling ones are ignored.
            struct stat sb;
-           if (stat(child_path, &sb) == -1)
-               die("cannot stat %s", child_path);
-           if (S_ISDIR(sb.st_mode)) {
+           if (stat(child_path, &sb) == -1) {
+               if (ep->d_type != DT_LNK)
+                   die("cannot stat %s", child_path);
+           } else if (S_ISDIR(sb.st_mode)) {
                type = CHILD_DIR;
            } else if (S_ISREG(sb.st_mode)) {
                type = CHILD_FILE;
@@ -1028,21 +1795,162 @@ static void node_search_and_boot(node_t *node) {
         }
 
         if (type == CHILD_DIR) {
-            node_t *child = node_add_child(node, child_path, child_name);
-            node_search_and_boot(child);
-            node_child_update(node, child->name, 1);
+            if (scan->num_dirs == scan->max_dirs) {
+                scan->max_dirs = scan->max_dirs ? scan->max_dirs * 2 : 8;
+                scan->dirs = realloc(scan->dirs, sizeof(char*) * scan->max_dirs);
+                if (!scan->dirs)
+                    die("cannot grow directory list");
+            }
+            scan->dirs[scan->num_dirs++] = strdup(child_name);
         } else if (type == CHILD_FILE && strcmp(child_name, NODE_CODE_FILE)) {
             node_content_update(node, child_name, 1);
         }
     }
     closedir(dp);
 
-    node_boot(node);
+    node_precompile(node);
+}
+
+static node_scan_t *node_scan_new(node_t *node) {
+    node_scan_t *scan = xmalloc(sizeof(node_scan_t));
+    scan->node = node;
+    return scan;
+}
+
+// Initializes node and all nodes below it, one directory level
+// at a time. The nodes of a level are scanned and get their lua
+// states in parallel on the workers. Booting happens later, a
+// few nodes per frame, parents first. See node_boot_queued.
+static void node_tree_init(node_t *node) {
+    node_scan_t **level = xmalloc(sizeof(node_scan_t*));
+    int level_size = 1;
+    level[0] = node_scan_new(node);
+
+    while (level_size) {
+        worker_run((void**)level, level_size, node_scan_job);
+
+        int next_size = 0;
+        for (int i = 0; i < level_size; i++)
+            next_size += level[i]->num_dirs;
+        node_scan_t **next = xmalloc(sizeof(node_scan_t*) * (next_size + 1));
+
+        next_size = 0;
+        for (int i = 0; i < level_size; i++) {
+            node_scan_t *scan = level[i];
+            node_t *node = scan->node;
+            lua_time += node->worker_time;
+            node->worker_time = 0;
+            node_handle_worker_memory(node);
+            node_queue_boot(node);
+            for (int d = 0; d < scan->num_dirs; d++) {
+                char child_path[PATH_MAX];
+                snprintf(child_path, sizeof(child_path), "%s/%s", node->path, scan->dirs[d]);
+                node_t *child = node_add_child(node, child_path, scan->dirs[d]);
+                node_child_update(node, child->name, 1);
+                next[next_size++] = node_scan_new(child);
+                free(scan->dirs[d]);
+            }
+            free(scan->dirs);
+            free(scan);
+        }
+        free(level);
+        level = next;
+        level_size = next_size;
+    }
+    free(level);
 }
 
 static void node_init_root(node_t *root, const char *base_path) {
     node_init(root, NULL, base_path, base_path);
-    node_search_and_boot(root);
+    node_tree_init(root);
+}
+
+/*======= Atomic updates =======*/
+
+// A child node directory can be a symlink. Renaming a new symlink
+// over it replaces the whole child at once: The new version boots
+// in the background while the old one keeps running. Once all of
+// it is booted, node_tree_swap replaces the old version.
+static void node_stage_child(node_t *node, node_t *child, const char *path) {
+    // Returns the existing watch if the symlink still
+    // points to the same directory.
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s/%s", node->dir, child->name);
+    int wd = inotify_add_watch(inotify_fd, dir, NODE_WATCH_MASK);
+    if (wd == child->wd) {
+        // pointed back to the active version while
+        // another one was staged: forget that one.
+        node_drop_replacement(child);
+        return;
+    }
+
+    node_drop_replacement(child);
+    fprintf(stderr, YELLOW("[%s]")" staging new version of child node %s\n", node->name, child->name);
+    node_t *staged = xmalloc(sizeof(node_t));
+    staged->staged = 1;
+    node_init(staged, node, path, child->name);
+    child->replacement = staged;
+    num_staged++;
+    node_tree_init(staged);
+}
+
+static int node_tree_booted(node_t *node) {
+    if (node->boot_queued)
+        return 0;
+    node_t *child, *tmp;
+    HASH_ITER(by_name, node->childs, child, tmp) {
+        if (!node_tree_booted(child))
+            return 0;
+    }
+    return 1;
+}
+
+// Make a staged node and all nodes below it reachable by path and alias
+static void node_link(node_t *node) {
+    node->staged = 0;
+    HASH_ADD_KEYPTR(by_path, nodes_by_path, node->path, strlen(node->path), node);
+    if (node->alias) {
+        node_t *existing_node;
+        HASH_FIND(by_alias, nodes_by_alias, node->alias, strlen(node->alias), existing_node);
+        if (existing_node) {
+            node_printf(node, "alias %s already taken by %s\n", node->alias, existing_node->path);
+            free(node->alias);
+            node->alias = NULL;
+        } else {
+            HASH_ADD_KEYPTR(by_alias, nodes_by_alias, node->alias, strlen(node->alias), node);
+        }
+    }
+    node_t *child, *tmp;
+    HASH_ITER(by_name, node->childs, child, tmp) {
+        node_link(child);
+    }
+}
+
+// Replace a child with its new version. The parent still sees
+// the same child name, so it doesn't get child events.
+static void node_swap(node_t *node, node_t *child) {
+    fprintf(stderr, YELLOW("[%s]")" switching to new version of child node %s\n", node->name, child->name);
+    node_t *replacement = child->replacement;
+    child->replacement = NULL;
+    num_staged--;
+
+    HASH_DELETE(by_name, node->childs, child);
+    node_free(child);
+    free(child);
+
+    node_link(replacement);
+    HASH_ADD_KEYPTR(by_name, node->childs, replacement->name, strlen(replacement->name), replacement);
+}
+
+static void node_tree_swap(node_t *node) {
+    node_t *child, *tmp;
+    HASH_ITER(by_name, node->childs, child, tmp) {
+        if (child->replacement && node_tree_booted(child->replacement)) {
+            node_swap(node, child);
+        } else {
+            node_tree_swap(child);
+        }
+    }
 }
 
 static node_t *node_find_by_path_or_alias(const char *needle) {
@@ -1058,12 +1966,15 @@ static node_t *node_find_by_path_or_alias(const char *needle) {
 static void node_print_profile(node_t *node, int depth) {
     node_t *child, *tmp; 
     double delta = (now - node->last_profile) * 1000;
-    fprintf(stderr, "%c%4dkb %3.0f %5.1f %6.1f %5d  %5d %5.1lf%% %5.1lf%% %5.1lf%% %*s '- %s (%s)\n", 
+    fprintf(stderr, "%c%5dkb %6dkb %6dkb %3.0f %5.1f %6.1f %6.1f %5d  %5d %5.1lf%% %5.1lf%% %5.1lf%% %*s '- %s (%s)\n", 
         node_is_blacklisted(node) ? 'X' : node_is_idle(node) ? ' ' : '*',
-        lua_gc(node->L, LUA_GCCOUNT, 0),
+        (int)(node_mem(node) / 1024),
+        (int)(node_peak_mem(node) / 1024),
+        (int)(texture_owner_bytes(&node->textures) / 1024),
         node->num_frames * 1000 / delta,
         (double)node->num_resource_inits * 1000 / delta,
         node->num_frames ?  (double)node->num_allocs / node->num_frames : 0.0,
+        node->num_frames ?  (double)node->num_culled / node->num_frames : 0.0,
         node->width, node->height,
         100 / delta * node->profiling[PROFILE_BOOT],
         100 / delta * node->profiling[PROFILE_UPDATE],
@@ -1076,15 +1987,203 @@ static void node_print_profile(node_t *node, int depth) {
     };
 }
 
+static long long node_tree_mem(node_t *node, int peak) {
+    long long mem = peak ? node_peak_mem(node) : node_mem(node);
+    node_t *child, *tmp;
+    HASH_ITER(by_name, node->childs, child, tmp) {
+        mem += node_tree_mem(child, peak);
+    };
+    return mem;
+}
+
+static long long node_tree_allocs(node_t *node) {
+    long long allocs = node->total_allocs;
+    node_t *child, *tmp;
+    HASH_ITER(by_name, node->childs, child, tmp) {
+        allocs += node_tree_allocs(child);
+    };
+    return allocs;
+}
+
+/*======= Garbage collection =======*/
+
+static node_t **gc_nodes = NULL;
+static int num_gc_nodes = 0;
+static int max_gc_nodes = 0;
+
+// Bytes allocated since the last completed cycle. Most of it is
+// probably garbage by now. Nodes close to their memory limit are
+// handled first.
+static long long node_gc_debt(node_t *node) {
+    long long mem = node_mem(node);
+    long long debt = mem - node->gc_base;
+    if (debt < 0)
+        node->gc_base = mem;
+    if (debt <= node->gc_base * GC_MIN_DEBT)
+        return 0;
+    if (node->alloc.limit && mem > (long long)node->alloc.limit / 4 * 3)
+        debt *= 4;
+    return debt;
+}
+
+static void node_tree_gc_collect(node_t *node, int idle) {
+    if (node_is_idle(node) == idle) {
+        if (num_gc_nodes == max_gc_nodes) {
+            max_gc_nodes = max_gc_nodes ? max_gc_nodes * 2 : 16;
+            gc_nodes = realloc(gc_nodes, sizeof(node_t*) * max_gc_nodes);
+            if (!gc_nodes)
+                die("cannot grow gc nodes");
+        }
+        gc_nodes[num_gc_nodes++] = node;
+    }
+    node_t *child, *tmp;
+    HASH_ITER(by_name, node->childs, child, tmp) {
+        node_tree_gc_collect(child, idle);
+    };
+}
+
+// Run gc steps until the deadline, always stepping the node with
+// the largest debt. Returns 0 if the deadline was reached.
+static int gc_run(double deadline) {
+    while (1) {
+        node_t *node = NULL;
+        long long max_debt = 0;
+        for (int i = 0; i < num_gc_nodes; i++) {
+            long long debt = node_gc_debt(gc_nodes[i]);
+            if (debt > max_debt) {
+                max_debt = debt;
+                node = gc_nodes[i];
+            }
+        }
+        if (!node)
+            return 1;
+        if (timing_real() >= deadline)
+            return 0;
+        if (lua_gc(node->L, LUA_GCSTEP, GC_STEP_SIZE))
+            node->gc_base = node_mem(node); // cycle completed
+    }
+}
+
+// Distribute gc steps over all nodes within the time left until
+// the next vsync, minus the time the next frame probably needs.
+// Idle nodes only get the slack remaining after that.
+static void gc_schedule(double frame_work) {
+    double t = timing_real();
+    double budget = (timing_next_vsync() - t - frame_work) * GC_BUDGET_SHARE;
+    double deadline = t + CLAMP(budget, GC_MIN_BUDGET, GC_MAX_BUDGET);
+
+    num_gc_nodes = 0;
+    node_tree_gc_collect(&root, 0);
+    if (!gc_run(deadline))
+        return;
+
+    num_gc_nodes = 0;
+    node_tree_gc_collect(&root, 1);
+    gc_run(deadline);
+}
+
 static void node_profiler() {
-    fprintf(stderr, "    mem fps   rps allocs width height   boot update  event     name (alias)\n");
-    fprintf(stderr, "---------------------------------------------------------------------------\n");
+    fprintf(stderr, "     mem     peak  texture fps   rps allocs culled width height   boot update  event     name (alias)\n");
+    fprintf(stderr, "----------------------------------------------------------------------------------------------------\n");
     node_print_profile(&root, 0);
-    fprintf(stderr, "---------------------------------------------------------------------------\n");
+    fprintf(stderr, "----------------------------------------------------------------------------------------------------\n");
+    fprintf(stderr, "textures: %lldkb", texture_total_bytes() / 1024);
+    for (int type = 0; type < TEXTURE_NUM_TYPES; type++)
+        fprintf(stderr, ", %s %lldkb", texture_type_name(type), texture_type_bytes(type) / 1024);
+    fprintf(stderr, "\n");
 }
 
 /*======= inotify ==========*/
 
+/*======= File events =======*/
+
+// A deploy changes many files at once and editors often write a
+// file more than once. Events are collected per node and file
+// and delivered once things have settled down.
+static void node_queue_content_update(node_t *node, const char *name, int added) {
+    double t = timing_real();
+    content_update_t *update;
+    HASH_FIND_STR(node->content_updates, name, update);
+    if (update) {
+        // move to the end, so events are delivered in the
+        // order of their most recent change
+        HASH_DEL(node->content_updates, update);
+    } else {
+        update = xmalloc(sizeof(content_update_t));
+        update->name = strdup(name);
+        update->first_event = t;
+        num_content_updates++;
+    }
+    update->added = added;
+    update->last_event = t;
+    HASH_ADD_KEYPTR(hh, node->content_updates, update->name, strlen(update->name), update);
+}
+
+static void content_update_free(node_t *node, content_update_t *update) {
+    HASH_DEL(node->content_updates, update);
+    free(update->name);
+    free(update);
+    num_content_updates--;
+}
+
+static void node_drop_content_updates(node_t *node) {
+    content_update_t *update, *tmp;
+    HASH_ITER(hh, node->content_updates, update, tmp) {
+        content_update_free(node, update);
+    }
+}
+
+#define content_update_ready(update, t) \
+    ((t) - (update)->last_event >= CONTENT_DEBOUNCE || \
+     (t) - (update)->first_event >= CONTENT_MAX_DELAY)
+
+// Deliver the settled file events of a node. New node code is
+// loaded first, so the other files of a deploy are handled by
+// the new code. Returns 1 if lua code was called.
+static int node_deliver_content_updates(node_t *node, double t) {
+    int called = 0;
+    content_update_t *update, *tmp;
+    HASH_FIND_STR(node->content_updates, NODE_CODE_FILE, update);
+    if (update) {
+        if (!content_update_ready(update, t))
+            return 0;
+        int added = update->added;
+        content_update_free(node, update);
+        node_content_update(node, NODE_CODE_FILE, added);
+        called = 1;
+    }
+
+    content_update_t *batch[MAX_CONTENT_BATCH];
+    int num_batch = 0;
+    HASH_ITER(hh, node->content_updates, update, tmp) {
+        if (num_batch == MAX_CONTENT_BATCH)
+            break;
+        if (content_update_ready(update, t))
+            batch[num_batch++] = update;
+    }
+    if (num_batch) {
+        node_content_batch(node, batch, num_batch);
+        for (int i = 0; i < num_batch; i++)
+            content_update_free(node, batch[i]);
+        called = 1;
+    }
+    return called;
+}
+
+// Deliver file events until the deadline has passed.
+static void deliver_content_updates(double deadline) {
+    if (!num_content_updates)
+        return;
+    double t = timing_real();
+    node_t *node, *tmp;
+    HASH_ITER(by_path, nodes_by_path, node, tmp) {
+        if (node->content_updates &&
+                node_deliver_content_updates(node, t) &&
+                timing_real() >= deadline)
+            break;
+    }
+}
+
 static void check_inotify() {
     static char inotify_buffer[sizeof(struct inotify_event) + PATH_MAX + 1];
     while (1) {
@@ -1113,16 +2212,26 @@ static void check_inotify() {
             if (event->mask & IN_IGNORED)
                 continue;
 
+            // events still queued for a watch that was
+            // removed when its node was freed.
             node_t *node;
             HASH_FIND(by_wd, nodes_by_wd, &event->wd, sizeof(int), node);
-            if (!node) 
-                die("node not found: %s", event->name);
+            if (!node)
+                continue;
 
-            char path[PATH_MAX];
-            snprintf(path, sizeof(path), "%s/%s", node->path, event->name);
+            // path is used for file access, child_path
+            // for the identity of a new child node.
+            char path[PATH_MAX], child_path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", node->dir, event->name);
+            snprintf(child_path, sizeof(child_path), "%s/%s", node->path, event->name);
             // fprintf(stderr, "event for %s (%s), mask: %08x\n", path, event->name, event->mask);
 
-            if (event->mask & IN_CREATE) {
+            // child node with the same name (directory or symlink)
+            node_t *child = NULL;
+            if (event->len)
+                HASH_FIND(by_name, node->childs, event->name, strlen(event->name), child);
+
+            if (event->mask & (IN_CREATE|IN_MOVED_TO)) {
                 struct stat stat_buf;
                 if (stat(path, &stat_buf) == -1) {
                     // file/path can be gone (race between inotify and 
@@ -1132,33 +2241,41 @@ static void check_inotify() {
                 }
 
                 if (S_ISDIR(stat_buf.st_mode)) {
-                    node_t *child = node_add_child(node, path, event->name);
-                    node_search_and_boot(child);
-                    node_child_update(node, child->name, 1);
+                    if (child) {
+                        node_stage_child(node, child, child_path);
+                    } else {
+                        child = node_add_child(node, child_path, event->name);
+                        node_tree_init(child);
+                        node_child_update(node, child->name, 1);
+                    }
                 } else if (S_ISREG(stat_buf.st_mode)) {
-                    node_content_update(node, event->name, 1);
+                    node_queue_content_update(node, event->name, 1);
                 }
             } else if (event->mask & IN_CLOSE_WRITE) {
-                node_content_update(node, event->name, 1);
+                node_queue_content_update(node, event->name, 1);
             } else if (event->mask & IN_DELETE_SELF) {
                 if (!node->parent)
                     die("root node deleted. cannot continue");
-                node_remove_child(node->parent, node);
+                node_t *active;
+                HASH_FIND(by_name, node->parent->childs, node->name, strlen(node->name), active);
+                if (active && active->replacement == node) {
+                    node_drop_replacement(active);
+                } else {
+                    node_remove_child(node->parent, node);
+                }
+            } else if (child && !(event->mask & IN_ISDIR)) {
+                // Symlink to a child removed. Keep the child if
+                // the symlink was replaced in the meantime.
+                struct stat stat_buf;
+                if (stat(path, &stat_buf) == -1 || !S_ISDIR(stat_buf.st_mode))
+                    node_remove_child(node, child);
             } else if (event->mask & IN_DELETE && !(event->mask & IN_ISDIR)) {
-                node_content_update(node, event->name, 0);
+                node_queue_content_update(node, event->name, 0);
             } else if (event->mask & IN_MOVED_FROM) {
                 if (event->mask & IN_ISDIR) {
                     node_remove_child_by_name(node, event->name);
                 } else {
-                    node_content_update(node, event->name, 0);
-                }
-            } else if (event->mask & IN_MOVED_TO) {
-                if (event->mask & IN_ISDIR) {
-                    node_t *child = node_add_child(node, path, event->name);
-                    node_search_and_boot(child);
-                    node_child_update(node, child->name, 1);
-                } else {
-                    node_content_update(node, event->name, 1);
+                    node_queue_content_update(node, event->name, 0);
                 }
             }
         }
@@ -1236,6 +2353,12 @@ static void udp_read(int fd, short event, void *arg) {
         die("recvfrom");
 
     assert(len > 0);
+    if (len > LITERAL_SIZE(SYNC_PREFIX) &&
+            !memcmp(buf, SYNC_PREFIX, LITERAL_SIZE(SYNC_PREFIX))) {
+        sync_receive(buf + LITERAL_SIZE(SYNC_PREFIX), len - LITERAL_SIZE(SYNC_PREFIX));
+        return;
+    }
+
     // own format:  <path>:<payload>
     int is_osc = 0;
     char payload_separator = ':';
@@ -1299,14 +2422,15 @@ static void udp_read(int fd, short event, void *arg) {
     lua_pushlstring(node->L, data, data_len);
     lua_pushboolean(node->L, is_osc);
     lua_pushstring(node->L, suffix);
-    node_event(node, "raw_data", 3);
+    node_event_threaded(node, "raw_data", 3);
 }
 
-static void open_udp(struct event *event) {
+static int open_udp(struct event *event) {
     int fd = create_socket(SOCK_DGRAM); 
     event_set(event, fd, EV_READ | EV_PERSIST, &udp_read, NULL);
     if (event_add(event, NULL) == -1)
         die("event_add failed");
+    return fd;
 }
 
 /*===== TCP Handler ========*/
@@ -1325,6 +2449,7 @@ static void client_close(client_t *client) {
         client->node = NULL;
     }
     bufferevent_free(client->buf_ev);
+    evbuffer_free(client->pending);
     close(client->fd);
     free(client);
 }
@@ -1340,7 +2465,7 @@ static void client_read(struct bufferevent *bev, void *arg) {
         if (client->node) {
             lua_pushstring(client->node->L, line);
             lua_pushlightuserdata(client->node->L, client);
-            node_event(client->node, "input", 2);
+            node_event_threaded(client->node, "input", 2);
         } else {
             node_t *node = node_find_by_path_or_alias(line);
             if (!node) {
@@ -1367,6 +2492,7 @@ static void client_error(struct bufferevent *bev, short what, void *arg) {
 static void client_create(int fd) {
     client_t *client = xmalloc(sizeof(client_t));
     client->fd = fd;
+    client->pending = evbuffer_new();
     client->buf_ev = bufferevent_new(
             fd,
             client_read,
@@ -1420,12 +2546,39 @@ static void open_tcp(struct event *event) {
 }
 
 static void tick() {
-    now = glfwGetTime();
-
+    struct timeval frame_start, frame_end;
+    gettimeofday(&frame_start, NULL);
+
+    static double last_frame = -1;
+    double frame_real_start = timing_real();
+    now = timing_frame_start();
+    // Only the clock seen by lua follows the leader. It jumps
+    // if the leader restarts; blacklists, idle detection and
+    // profiling stay on the local clock.
+    shared_now = now + sync_offset();
+    double dt = last_frame < 0 ? 0 : now - last_frame;
+    last_frame = now;
+    sync_frame(frame_count);
+
+    texture_next_frame();
     check_inotify();
+    node_boot_queued(timing_real() + BOOT_BUDGET);
+    if (num_staged)
+        node_tree_swap(&root);
+    deliver_content_updates(timing_real() + CONTENT_BUDGET);
+
+    double preload_deadline = timing_real() + PRELOAD_BUDGET;
+    while (timing_real() < preload_deadline && image_finish_preload())
+        ;
 
     event_loop(EVLOOP_NONBLOCK);
 
+    // Update phase: Threaded nodes handle their queued events
+    // and update on the workers, all other nodes update afterwards.
+    node_tree_update(&root, dt, 1);
+    node_run_scheduled();
+    node_tree_update(&root, dt, 0);
+
     glEnable(GL_TEXTURE_2D);
 
     glEnable(GL_BLEND);
@@ -1444,17 +2597,42 @@ static void tick() {
             -1000, 1000);
     glMatrixMode(GL_MODELVIEW);
     glLoadIdentity();
+    cull_reset();
 
     glClearColor(0.05, 0.05, 0.05, 1);
     glClear(GL_COLOR_BUFFER_BIT);
     node_render_self(&root, win_w, win_h);
 
-    glfwSwapBuffers(window);
-    glfwPollEvents();
+    // Smoothed time needed for everything up to the swap
+    static double frame_work = 0;
+    frame_work = frame_work * 0.9 + (timing_real() - frame_real_start) * 0.1;
 
-    node_tree_gc(&root);
+    if (headless) {
+        headless_swap();
+        if (dump_dir) {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/frame-%06d.png", dump_dir, frame_count);
+            headless_dump_frame(path, win_w, win_h);
+        }
+    } else {
+        glfwSwapBuffers(window);
+        glfwPollEvents();
+    }
+
+    timing_frame_end();
+
+    release_run(timing_real() + RELEASE_BUDGET);
+    gc_schedule(frame_work);
 
-    if (glfwWindowShouldClose(window))
+    gettimeofday(&frame_end, NULL);
+    if (stats_path)
+        stats_frame(time_delta(&frame_start, &frame_end));
+
+    frame_count++;
+    if (frame_limit && frame_count >= frame_limit)
+        running = 0;
+
+    if (!headless && glfwWindowShouldClose(window))
         running = 0;
 }
 
@@ -1484,8 +2662,22 @@ int main(int argc, char *argv[]) {
             "  INFOBEAMER_FULLSCALE=1   # Scale root node to full screen size\n"
             "  INFOBEAMER_WIDTH=<w>     # Width (default 1024)\n"
             "  INFOBEAMER_HEIGHT=<h>    # Height (default 768)\n"
+            "  INFOBEAMER_HEADLESS=1    # Render offscreen without a window\n"
+            "  INFOBEAMER_CLOCK=<mode>  # real, fixed or paced (default real, fixed if headless)\n"
+            "  INFOBEAMER_FPS=<fps>     # Frame rate of the fixed clock (default %d)\n"
+            "  INFOBEAMER_REFRESH=<hz>  # Refresh rate for the paced clock (default: detect)\n"
+            "  INFOBEAMER_SWAP_INTERVAL=<n> # Vsyncs per frame (default 1)\n"
+            "  INFOBEAMER_FRAMES=<n>    # Exit after rendering n frames\n"
+            "  INFOBEAMER_DUMP=<dir>    # Save each rendered frame as png into <dir>\n"
+            "  INFOBEAMER_STATS=<file>  # Write frame time statistics as json on exit\n"
+            "  INFOBEAMER_WORKERS=<n>   # Worker threads for threaded nodes (default 0)\n"
+            "  INFOBEAMER_MEM_LIMIT=<kb> # Memory limit per node (default %d, 0: unlimited)\n"
+            "  INFOBEAMER_NODE_MEM_LIMITS=<path>:<kb>,... # Memory limits for single nodes\n"
+            "  INFOBEAMER_TEXTURE_BUDGET=<mb> # Texture memory budget (default 0: unlimited)\n"
+            "  INFOBEAMER_TILE=<x>,<y>,<w>,<h> # Only show this part of the root node\n"
+            "  INFOBEAMER_SYNC=<role>   # Sync clocks: leader:<addr>[:<port>] or follower\n"
             "\n",
-            argv[0], LISTEN_ADDR, DEFAULT_PORT);
+            argv[0], LISTEN_ADDR, DEFAULT_PORT, DEFAULT_FPS, MAX_MEM);
         exit(1);
     }
 
@@ -1522,12 +2714,39 @@ int main(int argc, char *argv[]) {
     fprintf(stderr, INFO("tcp/udp port is %d\n"), listen_port);
 
     struct event udp_event;
-    open_udp(&udp_event);
+    int udp_fd = open_udp(&udp_event);
 
     struct event tcp_event;
     open_tcp(&tcp_event);
 
-    if (!glfwInit())
+    headless = getenv("INFOBEAMER_HEADLESS") != NULL;
+
+    int clock_mode = headless ? TIMING_FIXED : TIMING_REAL;
+    const char *clock_name = getenv("INFOBEAMER_CLOCK");
+    if (clock_name) {
+        if (!strcmp(clock_name, "real"))
+            clock_mode = TIMING_REAL;
+        else if (!strcmp(clock_name, "fixed"))
+            clock_mode = TIMING_FIXED;
+        else if (!strcmp(clock_name, "paced"))
+            clock_mode = TIMING_PACED;
+        else
+            die("invalid INFOBEAMER_CLOCK value. use real, fixed or paced");
+    }
+
+    const char *swap_interval_value = getenv("INFOBEAMER_SWAP_INTERVAL");
+    int swap_interval = swap_interval_value ? atoi(swap_interval_value) : 1;
+    if (swap_interval < 0)
+        die("invalid INFOBEAMER_SWAP_INTERVAL value");
+
+    const char *frames = getenv("INFOBEAMER_FRAMES");
+    if (frames)
+        frame_limit = atoi(frames);
+
+    dump_dir = getenv("INFOBEAMER_DUMP");
+    stats_path = getenv("INFOBEAMER_STATS");
+
+    if (!headless && !glfwInit())
         die("cannot initialize glfw");
 
     int fullscreen = getenv("INFOBEAMER_FULLSCREEN") != NULL;
@@ -1544,47 +2763,135 @@ int main(int argc, char *argv[]) {
 
     fprintf(stderr, INFO("initial size is %dx%d\n"), width, height);
 
-    GLFWmonitor* monitor = glfwGetPrimaryMonitor();
-    if (!fullscreen)
-        monitor = NULL;
+    if (headless) {
+        headless_init(width, height);
+        win_w = width;
+        win_h = height;
+    } else {
+        GLFWmonitor* monitor = glfwGetPrimaryMonitor();
+        if (!fullscreen)
+            monitor = NULL;
 
-    window = glfwCreateWindow(width, height, VERSION_STRING, monitor, NULL);
-    if (!window)
-        die("cannot open window");
+        window = glfwCreateWindow(width, height, VERSION_STRING, monitor, NULL);
+        if (!window)
+            die("cannot open window");
 
-    glfwSetFramebufferSizeCallback(window, reshape);
-    glfwSetKeyCallback(window, keypressed);
+        glfwSetFramebufferSizeCallback(window, reshape);
+        glfwSetKeyCallback(window, keypressed);
 
-    glfwMakeContextCurrent(window);
-    glfwSwapInterval(1);
+        glfwMakeContextCurrent(window);
+        glfwSwapInterval(swap_interval);
 
-    glfwGetFramebufferSize(window, &win_w, &win_h);
+        glfwGetFramebufferSize(window, &win_w, &win_h);
+    }
 
     GLenum err = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+    // GL functions are available, but there are no
+    // GLX extensions when using an EGL context.
+    if (headless && err == GLEW_ERROR_NO_GLX_DISPLAY)
+        err = GLEW_OK;
+#endif
     if (err != GLEW_OK)
         die("cannot initialize glew");
     if (!glewIsSupported("GL_VERSION_3_0"))
         die("need opengl 3.0 support\n");
 
-    if (fullscreen)
+    if (fullscreen && !headless)
         glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
 
     ilInit();
     iluInit();
+    preload_init(PRELOAD_NODE_MEM * 1024LL);
 
     signal(SIGVTALRM, deadline_signal);
 
+    const char *mem_limit_value = getenv("INFOBEAMER_MEM_LIMIT");
+    if (mem_limit_value)
+        mem_limit = atoi(mem_limit_value);
+    if (mem_limit < 0)
+        die("invalid INFOBEAMER_MEM_LIMIT value");
+    node_mem_limits = getenv("INFOBEAMER_NODE_MEM_LIMITS");
+
+    const char *texture_budget = getenv("INFOBEAMER_TEXTURE_BUDGET");
+    if (texture_budget) {
+        if (atoi(texture_budget) < 0)
+            die("invalid INFOBEAMER_TEXTURE_BUDGET value");
+        texture_set_budget(atoi(texture_budget) * 1024LL * 1024);
+    }
+
+    const char *tile = getenv("INFOBEAMER_TILE");
+    if (tile) {
+        if (sscanf(tile, "%d,%d,%d,%d", &tile_x, &tile_y, &tile_w, &tile_h) != 4 ||
+                tile_w <= 0 || tile_h <= 0)
+            die("invalid INFOBEAMER_TILE value");
+        fprintf(stderr, INFO("showing %dx%d tile at %d,%d of the root node\n"),
+            tile_w, tile_h, tile_x, tile_y);
+    }
+
+#ifdef USE_LUAJIT
+    luajit_probe_alloc();
+#endif
+
+    const char *workers = getenv("INFOBEAMER_WORKERS");
+    worker_init(workers ? atoi(workers) : 0);
+
     init_default_texture();
 
-    now = glfwGetTime();
+    double frame_period;
+    if (clock_mode == TIMING_FIXED) {
+        const char *fps = getenv("INFOBEAMER_FPS");
+        frame_period = 1.0 / (fps ? atof(fps) : DEFAULT_FPS);
+    } else {
+        // The paced clock advances in multiples of the
+        // display refresh period.
+        const char *refresh_value = getenv("INFOBEAMER_REFRESH");
+        double refresh = refresh_value ? atof(refresh_value) : 0;
+        if (!refresh && !headless) {
+            const GLFWvidmode *mode = glfwGetVideoMode(glfwGetPrimaryMonitor());
+            if (mode)
+                refresh = mode->refreshRate;
+        }
+        if (!refresh)
+            refresh = DEFAULT_FPS;
+        frame_period = (swap_interval ? swap_interval : 1) / refresh;
+    }
+    if (frame_period <= 0)
+        die("invalid frame rate");
+    timing_init(clock_mode, frame_period);
+    fprintf(stderr, INFO("%s clock, %.2f fps\n"),
+        clock_mode == TIMING_REAL ? "real" : clock_mode == TIMING_FIXED ? "fixed" : "paced",
+        1.0 / frame_period);
+
+    const char *sync = getenv("INFOBEAMER_SYNC");
+    if (sync) {
+        if (clock_mode == TIMING_FIXED)
+            die("INFOBEAMER_SYNC needs the real or paced clock");
+        sync_init(udp_fd, sync, listen_port);
+    }
+
+    now = shared_now = timing_frame_start();
     node_init_root(&root, root_name);
 
+    // Rendered frames have to be reproducible without
+    // a window, so boot everything before the first one.
+    if (headless) {
+        while (boot_queue_len)
+            node_boot_queued(0);
+    }
+
     fprintf(stderr, INFO("initialization completed\n"));
 
     while (running) {
         tick();
     }
 
+    if (stats_path) {
+        stats_lua_memory(node_tree_mem(&root, 0),
+            lua_peak_mem + node_tree_mem(&root, 1), mem_violations);
+        stats_write(stats_path, lua_time, lua_allocs + node_tree_allocs(&root));
+    }
+
     // no cleanup :-}
     return 0;
 }
@@ -20,7 +20,7 @@ void die(const char *fmt, ...) {
 
 double time_delta(struct timeval *before, struct timeval *after) {
     double delta_seconds = after->tv_sec - before->tv_sec;
-    double delta_milliseconds = (after->tv_usec - before->tv_usec) / 1000;
+    double delta_milliseconds = (after->tv_usec - before->tv_usec) / 1000.0;
 
     if (delta_milliseconds < 0) {
         delta_milliseconds += 1000;
@@ -0,0 +1,148 @@
+/* See Copyright Notice in LICENSE.txt */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "misc.h"
+#include "utlist.h"
+#include "image.h"
+#include "preload.h"
+
+static pthread_t thread;
+static int started = 0;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_available = PTHREAD_COND_INITIALIZER;
+
+// all jobs not yet taken by the render thread, protected by lock
+static preload_t *jobs = NULL;
+
+// decoded bytes waiting for the render thread per owner
+static size_t owner_budget;
+
+static size_t decoded_bytes(void *owner) {
+    size_t bytes = 0;
+    preload_t *job;
+    DL_FOREACH(jobs, job) {
+        if (job->owner == owner && job->state == PRELOAD_DECODED)
+            bytes += (size_t)job->width * job->height * 4;
+    }
+    return bytes;
+}
+
+// Highest priority first. Owners with too many decoded
+// images waiting for upload have to wait.
+static preload_t *next_job() {
+    preload_t *best = NULL, *job;
+    DL_FOREACH(jobs, job) {
+        if (job->state != PRELOAD_QUEUED)
+            continue;
+        if (best && job->priority <= best->priority)
+            continue;
+        if (decoded_bytes(job->owner) >= owner_budget)
+            continue;
+        best = job;
+    }
+    return best;
+}
+
+static void *preload_main(void *arg) {
+    pthread_mutex_lock(&lock);
+    while (1) {
+        preload_t *job = next_job();
+        if (!job) {
+            pthread_cond_wait(&work_available, &lock);
+            continue;
+        }
+        job->state = PRELOAD_DECODING;
+        pthread_mutex_unlock(&lock);
+
+        int ok = image_decode(job->path, &job->width, &job->height,
+            &job->pixels, job->error, sizeof(job->error));
+
+        pthread_mutex_lock(&lock);
+        if (job->cancelled) {
+            DL_DELETE(jobs, job);
+            preload_free(job);
+        } else {
+            job->state = ok ? PRELOAD_DECODED : PRELOAD_FAILED;
+        }
+    }
+    return NULL;
+}
+
+static void start_thread() {
+    // Same as the workers: Only the render thread
+    // may receive signals.
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    if (pthread_create(&thread, NULL, preload_main, NULL))
+        die("cannot start preload thread");
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    started = 1;
+}
+
+void preload_init(size_t budget) {
+    owner_budget = budget;
+}
+
+preload_t *preload_queue(const char *path, int priority, void *owner, void *image) {
+    if (!started)
+        start_thread();
+
+    preload_t *job = xmalloc(sizeof(preload_t));
+    job->path = strdup(path);
+    job->priority = priority;
+    job->owner = owner;
+    job->image = image;
+    job->state = PRELOAD_QUEUED;
+
+    pthread_mutex_lock(&lock);
+    DL_APPEND(jobs, job);
+    pthread_cond_signal(&work_available);
+    pthread_mutex_unlock(&lock);
+    return job;
+}
+
+// The image was collected. A job currently being
+// decoded is freed by the preload thread.
+void preload_cancel(preload_t *job) {
+    pthread_mutex_lock(&lock);
+    if (job->state == PRELOAD_DECODING) {
+        job->cancelled = 1;
+    } else {
+        DL_DELETE(jobs, job);
+        preload_free(job);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// Take the next decoded or failed job. The caller frees it.
+preload_t *preload_finished() {
+    preload_t *job, *found = NULL;
+    pthread_mutex_lock(&lock);
+    DL_FOREACH(jobs, job) {
+        if (job->state == PRELOAD_DECODED || job->state == PRELOAD_FAILED) {
+            found = job;
+            break;
+        }
+    }
+    if (found) {
+        DL_DELETE(jobs, found);
+        // might make room in the owner's budget
+        pthread_cond_signal(&work_available);
+    }
+    pthread_mutex_unlock(&lock);
+    return found;
+}
+
+void preload_free(preload_t *job) {
+    free(job->path);
+    free(job->pixels);
+    free(job);
+}
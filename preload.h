@@ -0,0 +1,39 @@
+/* See Copyright Notice in LICENSE.txt */
+
+#ifndef PRELOAD_H
+#define PRELOAD_H
+
+#include <stddef.h>
+
+typedef enum {
+    PRELOAD_QUEUED,
+    PRELOAD_DECODING,
+    PRELOAD_DECODED,
+    PRELOAD_FAILED,
+} preload_state;
+
+// An image decoded on the preload thread. Once decoded, the render
+// thread takes it with preload_finished and uploads the pixels.
+typedef struct preload_s {
+    char *path;
+    int priority;       // higher priorities are decoded first
+    void *owner;        // node that started the preload
+    void *image;        // image waiting for the result
+    preload_state state;
+    int cancelled;      // image was collected while decoding
+
+    int width;
+    int height;
+    unsigned char *pixels; // RGBA
+    char error[256];
+
+    struct preload_s *prev, *next;
+} preload_t;
+
+void preload_init(size_t owner_budget);
+preload_t *preload_queue(const char *path, int priority, void *owner, void *image);
+void preload_cancel(preload_t *job);
+preload_t *preload_finished();
+void preload_free(preload_t *job);
+
+#endif
@@ -0,0 +1,147 @@
+/* See Copyright Notice in LICENSE.txt */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include <GL/glew.h>
+#include <GL/gl.h>
+
+#include "utlist.h"
+#include "misc.h"
+#include "stats.h"
+#include "timing.h"
+#include "framebuffer.h"
+#include "release.h"
+
+// Lua finalizers run whenever the gc steps, even inside another
+// node's render or on a worker thread. They only queue their GL
+// objects here. The render thread deletes them after the swap.
+
+typedef enum {
+    RELEASE_TEXTURE,
+    RELEASE_FRAMEBUFFER,
+    RELEASE_PROGRAM,
+    RELEASE_CALL,
+} release_type;
+
+typedef struct release_s {
+    release_type type;
+    GLuint id[3];
+    int width;
+    int height;
+    int reusable;       // RGBA texture with mipmaps
+    release_func func;
+    void *ptr;
+    struct release_s *prev, *next;
+} release_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static release_t *queue = NULL;
+
+static void enqueue(release_t *entry) {
+    pthread_mutex_lock(&lock);
+    DL_APPEND(queue, entry);
+    pthread_mutex_unlock(&lock);
+}
+
+void release_texture(GLuint tex, int width, int height, int reusable) {
+    release_t *entry = xmalloc(sizeof(release_t));
+    entry->type = RELEASE_TEXTURE;
+    entry->id[0] = tex;
+    entry->width = width;
+    entry->height = height;
+    entry->reusable = reusable;
+    enqueue(entry);
+}
+
+// The framebuffer goes back into the recycler
+void release_framebuffer(GLuint tex, GLuint fbo, int width, int height) {
+    release_t *entry = xmalloc(sizeof(release_t));
+    entry->type = RELEASE_FRAMEBUFFER;
+    entry->id[0] = tex;
+    entry->id[1] = fbo;
+    entry->width = width;
+    entry->height = height;
+    enqueue(entry);
+}
+
+void release_program(GLuint po, GLuint vs, GLuint fs) {
+    release_t *entry = xmalloc(sizeof(release_t));
+    entry->type = RELEASE_PROGRAM;
+    entry->id[0] = po;
+    entry->id[1] = vs;
+    entry->id[2] = fs;
+    enqueue(entry);
+}
+
+// Calls func(ptr) on the render thread
+void release_call(release_func func, void *ptr) {
+    release_t *entry = xmalloc(sizeof(release_t));
+    entry->type = RELEASE_CALL;
+    entry->func = func;
+    entry->ptr = ptr;
+    enqueue(entry);
+}
+
+// Takes a released texture of the given size instead of creating
+// a new one. Returns 0 if there is none.
+GLuint release_reuse_texture(int width, int height) {
+    release_t *entry, *found = NULL;
+    pthread_mutex_lock(&lock);
+    DL_FOREACH(queue, entry) {
+        if (entry->type == RELEASE_TEXTURE && entry->reusable &&
+            entry->width == width && entry->height == height)
+        {
+            found = entry;
+            break;
+        }
+    }
+    if (found)
+        DL_DELETE(queue, found);
+    pthread_mutex_unlock(&lock);
+
+    if (!found)
+        return 0;
+    GLuint tex = found->id[0];
+    stats_texture(width, height, 0);
+    free(found);
+    return tex;
+}
+
+static void release(release_t *entry) {
+    switch (entry->type) {
+        case RELEASE_TEXTURE:
+            glDeleteTextures(1, &entry->id[0]);
+            stats_texture(entry->width, entry->height, 0);
+            break;
+        case RELEASE_FRAMEBUFFER:
+            recycle_framebuffer(entry->width, entry->height,
+                entry->id[0], entry->id[1]);
+            break;
+        case RELEASE_PROGRAM:
+            glDeleteProgram(entry->id[0]);
+            glDeleteShader(entry->id[1]);
+            glDeleteShader(entry->id[2]);
+            break;
+        case RELEASE_CALL:
+            entry->func(entry->ptr);
+            break;
+    }
+    free(entry);
+}
+
+// Releases queued objects until the deadline, but at least one,
+// so the queue cannot grow forever.
+void release_run(double deadline) {
+    do {
+        pthread_mutex_lock(&lock);
+        release_t *entry = queue;
+        if (entry)
+            DL_DELETE(queue, entry);
+        pthread_mutex_unlock(&lock);
+        if (!entry)
+            return;
+        release(entry);
+    } while (timing_real() < deadline);
+}
@@ -0,0 +1,17 @@
+/* See Copyright Notice in LICENSE.txt */
+
+#ifndef RELEASE_H
+#define RELEASE_H
+
+#include <GL/gl.h>
+
+typedef void (*release_func)(void *ptr);
+
+void release_texture(GLuint tex, int width, int height, int reusable);
+void release_framebuffer(GLuint tex, GLuint fbo, int width, int height);
+void release_program(GLuint po, GLuint vs, GLuint fs);
+void release_call(release_func func, void *ptr);
+GLuint release_reuse_texture(int width, int height);
+void release_run(double deadline);
+
+#endif
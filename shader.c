@@ -11,6 +11,8 @@
 #include <lualib.h>
 
 #include "misc.h"
+#include "worker.h"
+#include "release.h"
 
 typedef struct {
     GLuint fs;
@@ -20,11 +22,27 @@ typedef struct {
 
 LUA_TYPE_DECL(shader)
 
+// The program last activated with shader_use_program. Reading
+// it back from GL on every draw stalls the pipeline.
+static GLuint current_program = 0;
+
+void shader_use_program(GLuint po) {
+    glUseProgram(po);
+    current_program = po;
+}
+
+GLuint shader_current_program() {
+    return current_program;
+}
+
 /* Instance methods */
 
 static int shader_use(lua_State *L) {
+    require_render_thread(L);
     shader_t *shader = checked_shader(L, 1);
-    glUseProgram(shader->po);
+    if (!shader->po)
+        return luaL_error(L, "resource disposed");
+    shader_use_program(shader->po);
 
     // No variables?
     if (lua_gettop(L) == 1)
@@ -106,13 +124,23 @@ static int shader_use(lua_State *L) {
 }
 
 static int shader_deactivate(lua_State *L) {
-    glUseProgram(0);
+    require_render_thread(L);
+    shader_use_program(0);
+    return 0;
+}
+
+static int shader_dispose(lua_State *L) {
+    shader_t *shader = checked_shader(L, 1);
+    if (shader->po)
+        release_program(shader->po, shader->vs, shader->fs);
+    shader->po = shader->vs = shader->fs = 0;
     return 0;
 }
 
 static const luaL_reg shader_methods[] = {
     {"use",         shader_use},
     {"deactivate",  shader_deactivate},
+    {"dispose",     shader_dispose},
     {0,0}
 };
 
@@ -186,9 +214,8 @@ error:
 
 static int shader_gc(lua_State *L) {
     shader_t *shader = to_shader(L, 1);
-    glDeleteProgram(shader->po);
-    glDeleteShader(shader->vs);
-    glDeleteShader(shader->fs);
+    if (shader->po)
+        release_program(shader->po, shader->vs, shader->fs);
     return 0;
 }
 
@@ -196,10 +223,10 @@ LUA_TYPE_IMPL(shader)
 
 void shader_set_gl_color(GLfloat r, GLfloat g, GLfloat b, GLfloat a) {
     glColor4f(r, g, b, a);
+    if (!current_program)
+        return;
 
-    GLint prog, color;
-    glGetIntegerv(GL_CURRENT_PROGRAM, &prog);
-    color = glGetUniformLocation(prog, "Color");
+    GLint color = glGetUniformLocation(current_program, "Color");
     if (color != -1)
         glUniform4f(color, r, g, b, a);
 }
@@ -6,5 +6,7 @@
 int shader_register(lua_State *L);
 int shader_new(lua_State *L, const char *vertex, const char *fragment);
 void shader_set_gl_color(GLfloat r, GLfloat g, GLfloat b, GLfloat a);
+void shader_use_program(GLuint po);
+GLuint shader_current_program();
 
 #endif
@@ -0,0 +1,121 @@
+/* See Copyright Notice in LICENSE.txt */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "misc.h"
+#include "stats.h"
+
+static double *frame_times = NULL;
+static int num_frames = 0;
+static int max_frames = 0;
+
+static long long texture_bytes = 0;
+static long long peak_texture_bytes = 0;
+
+static long long lua_memory = 0;
+static long long peak_lua_memory = 0;
+static int mem_limit_violations = 0;
+
+void stats_frame(double frame_time) {
+    if (num_frames == max_frames) {
+        max_frames = max_frames ? max_frames * 2 : 1024;
+        frame_times = realloc(frame_times, sizeof(double) * max_frames);
+        if (!frame_times)
+            die("cannot grow frame time buffer");
+    }
+    frame_times[num_frames++] = frame_time;
+}
+
+void stats_texture(int width, int height, int added) {
+    // Base level only, assuming 4 bytes per pixel.
+    long long bytes = (long long)width * height * 4;
+    texture_bytes += added ? bytes : -bytes;
+    if (texture_bytes > peak_texture_bytes)
+        peak_texture_bytes = texture_bytes;
+}
+
+// Sums over all nodes, set before stats_write
+void stats_lua_memory(long long current, long long peak, int violations) {
+    lua_memory = current;
+    peak_lua_memory = peak;
+    mem_limit_violations = violations;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double da = *(const double*)a, db = *(const double*)b;
+    return da < db ? -1 : da > db;
+}
+
+static double percentile(double *sorted, int num, int pct) {
+    if (num == 0)
+        return 0;
+    // nearest rank
+    int rank = (pct * num + 99) / 100;
+    return sorted[CLAMP(rank, 1, num) - 1];
+}
+
+void stats_write(const char *path, double lua_time, long long lua_allocs) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, ERROR("cannot write stats to %s\n"), path);
+        return;
+    }
+
+    double *sorted = xmalloc(sizeof(double) * (num_frames + 1));
+    double total = 0;
+    for (int i = 0; i < num_frames; i++) {
+        sorted[i] = frame_times[i];
+        total += frame_times[i];
+    }
+    qsort(sorted, num_frames, sizeof(double), compare_double);
+
+    int frames = num_frames ? num_frames : 1;
+    fprintf(f,
+        "{\n"
+        "  \"frames\": %d,\n"
+        "  \"frame_time_ms\": {\n"
+        "    \"mean\": %.3f,\n"
+        "    \"p50\": %.3f,\n"
+        "    \"p90\": %.3f,\n"
+        "    \"p99\": %.3f,\n"
+        "    \"max\": %.3f\n"
+        "  },\n"
+        "  \"lua_cpu_ms\": {\n"
+        "    \"total\": %.3f,\n"
+        "    \"per_frame\": %.3f\n"
+        "  },\n"
+        "  \"lua_allocs\": {\n"
+        "    \"total\": %lld,\n"
+        "    \"per_frame\": %.1f\n"
+        "  },\n"
+        "  \"texture_bytes\": {\n"
+        "    \"current\": %lld,\n"
+        "    \"peak\": %lld\n"
+        "  },\n"
+        "  \"lua_memory_bytes\": {\n"
+        "    \"current\": %lld,\n"
+        "    \"peak\": %lld\n"
+        "  },\n"
+        "  \"mem_limit_violations\": %d\n"
+        "}\n",
+        num_frames,
+        total / frames,
+        percentile(sorted, num_frames, 50),
+        percentile(sorted, num_frames, 90),
+        percentile(sorted, num_frames, 99),
+        num_frames ? sorted[num_frames - 1] : 0.0,
+        lua_time,
+        lua_time / frames,
+        lua_allocs,
+        (double)lua_allocs / frames,
+        texture_bytes,
+        peak_texture_bytes,
+        lua_memory,
+        peak_lua_memory,
+        mem_limit_violations
+    );
+    fclose(f);
+    free(sorted);
+    fprintf(stderr, INFO("stats written to %s\n"), path);
+}
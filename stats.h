@@ -0,0 +1,11 @@
+/* See Copyright Notice in LICENSE.txt */
+
+#ifndef STATS_H
+#define STATS_H
+
+void stats_frame(double frame_time);
+void stats_texture(int width, int height, int added);
+void stats_lua_memory(long long current, long long peak, int violations);
+void stats_write(const char *path, double lua_time, long long lua_allocs);
+
+#endif
@@ -0,0 +1,128 @@
+/* See Copyright Notice in LICENSE.txt */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "misc.h"
+#include "timing.h"
+#include "sync.h"
+
+// Keeps the clocks of several instances in sync. The leader sends
+// its frame number and clock over udp. Followers receive them on
+// their normal udp port and shift the clock lua sees (sys.now()
+// and everything derived from it, like video positions) to match.
+//
+//   #sync:<frame> <time>
+
+#define SYNC_INTERVAL 0.1   // seconds between packets sent by the leader
+#define SYNC_GAIN 0.1       // share of the measured clock difference applied per packet
+#define SYNC_SNAP 0.5       // jump to the leader clock if further away than that (s)
+
+#define ROLE_NONE     0
+#define ROLE_LEADER   1
+#define ROLE_FOLLOWER 2
+
+static int role = ROLE_NONE;
+static int sock;
+static struct sockaddr_in target;
+static double next_send = 0;
+
+static double offset = 0;   // leader clock - own clock
+static int synced = 0;
+static int leader_frame = -1;
+static double leader_last;  // leader clock of the last packet
+
+// spec is either "leader:<addr>[:<port>]" or "follower"
+void sync_init(int fd, const char *spec, int default_port) {
+    sock = fd;
+    if (!strcmp(spec, "follower")) {
+        role = ROLE_FOLLOWER;
+        fprintf(stderr, INFO("sync: waiting for the leader\n"));
+        return;
+    }
+    if (strncmp(spec, "leader:", 7))
+        die("invalid INFOBEAMER_SYNC value");
+
+    char addr[64];
+    int port = default_port;
+    if (sscanf(spec + 7, "%63[^:]:%d", addr, &port) < 1)
+        die("invalid INFOBEAMER_SYNC value");
+
+    memset(&target, 0, sizeof(target));
+    target.sin_family = AF_INET;
+    target.sin_port = htons(port);
+    if (!inet_aton(addr, &target.sin_addr))
+        die("invalid sync address %s", addr);
+
+    int one = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_BROADCAST, &one, sizeof(int)) < 0)
+        die("setsockopt broadcast failed");
+
+    role = ROLE_LEADER;
+    fprintf(stderr, INFO("sync: leading %s port %d\n"), addr, port);
+}
+
+int sync_is_follower() {
+    return role == ROLE_FOLLOWER;
+}
+
+// Called once per frame by the leader
+void sync_frame(int frame) {
+    if (role != ROLE_LEADER)
+        return;
+    double t = timing_real();
+    if (t < next_send)
+        return;
+    next_send = t + SYNC_INTERVAL;
+
+    char buf[64];
+    int len = snprintf(buf, sizeof(buf), SYNC_PREFIX "%d %.6f", frame, t);
+    sendto(sock, buf, len, 0, (struct sockaddr *)&target, sizeof(target));
+}
+
+// Handles a sync packet, starting after SYNC_PREFIX
+void sync_receive(const char *data, int len) {
+    if (role != ROLE_FOLLOWER)
+        return;
+
+    char buf[64];
+    int frame;
+    double leader_time;
+    if (len >= sizeof(buf))
+        return;
+    memcpy(buf, data, len);
+    buf[len] = '\0';
+    if (sscanf(buf, "%d %lf", &frame, &leader_time) != 2)
+        return;
+
+    // Reordered packet. If the clock went back further,
+    // the leader was restarted.
+    if (synced && frame <= leader_frame && leader_time > leader_last - SYNC_SNAP)
+        return;
+    leader_frame = frame;
+    leader_last = leader_time;
+
+    // The packet took a while to arrive, so this slightly
+    // underestimates the leader clock. On a local network,
+    // that's well below a frame.
+    double sample = leader_time - timing_real();
+    if (!synced || sample - offset > SYNC_SNAP || sample - offset < -SYNC_SNAP) {
+        fprintf(stderr, INFO("sync: clock jumps by %+.3fs to leader frame %d\n"),
+            sample - offset, frame);
+        offset = sample;
+        synced = 1;
+    } else {
+        offset += (sample - offset) * SYNC_GAIN;
+    }
+}
+
+// Added to the frame time lua sees (sys.now()) on followers
+double sync_offset() {
+    return offset;
+}
@@ -0,0 +1,14 @@
+/* See Copyright Notice in LICENSE.txt */
+
+#ifndef SYNC_H
+#define SYNC_H
+
+#define SYNC_PREFIX "#sync:"
+
+void sync_init(int fd, const char *spec, int default_port);
+int sync_is_follower();
+void sync_frame(int frame);
+void sync_receive(const char *data, int len);
+double sync_offset();
+
+#endif
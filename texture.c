@@ -0,0 +1,174 @@
+/* See Copyright Notice in LICENSE.txt */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "utlist.h"
+#include "misc.h"
+#include "framebuffer.h"
+#include "texture.h"
+
+// Finalizers on worker threads remove textures as well
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long long type_bytes[TEXTURE_NUM_TYPES];
+static long long total_bytes = 0;
+static long long budget = 0; // 0: unlimited
+static int over_budget = 0;  // already reported
+
+static texture_owner_t *current_owner = NULL;
+static texture_t *evictable = NULL;
+static int frame = 0;
+
+static const char *type_names[TEXTURE_NUM_TYPES] = {
+    "image", "snapshot", "fbo", "video", "vnc",
+};
+
+// RGBA, plus a third for the mipmaps
+long long texture_size(int width, int height, int mipmap) {
+    long long bytes = (long long)width * height * 4;
+    return mipmap ? bytes + bytes / 3 : bytes;
+}
+
+void texture_set_budget(long long bytes) {
+    budget = bytes;
+}
+
+// Textures created from now on belong to owner. Returns the
+// previous owner. Only used on the render thread.
+texture_owner_t *texture_swap_owner(texture_owner_t *owner) {
+    texture_owner_t *prev = current_owner;
+    current_owner = owner;
+    return prev;
+}
+
+void texture_owner_drawn(texture_owner_t *owner) {
+    owner->last_drawn = frame;
+}
+
+static int is_older(texture_t *a, texture_t *b) {
+    if (a->owner->last_drawn != b->owner->last_drawn)
+        return a->owner->last_drawn < b->owner->last_drawn;
+    return a->last_drawn < b->last_drawn;
+}
+
+static void unlink_texture(texture_t *texture) {
+    if (!texture->bytes)
+        return;
+    if (texture->owner)
+        texture->owner->bytes[texture->type] -= texture->bytes;
+    type_bytes[texture->type] -= texture->bytes;
+    total_bytes -= texture->bytes;
+    texture->bytes = 0;
+    if (texture->evict)
+        DL_DELETE(evictable, texture);
+}
+
+// Evicts textures not drawn in the previous frame, starting with
+// the least recently drawn nodes, until the budget is met again.
+// Called with the lock held.
+static void enforce_budget() {
+    if (!budget || total_bytes <= budget) {
+        over_budget = 0;
+        return;
+    }
+
+    // unused framebuffers go first
+    pthread_mutex_unlock(&lock);
+    framebuffer_flush();
+    pthread_mutex_lock(&lock);
+
+    while (total_bytes > budget) {
+        texture_t *texture, *oldest = NULL;
+        DL_FOREACH(evictable, texture) {
+            if (texture->last_drawn >= frame - 1)
+                continue;
+            if (!oldest || is_older(texture, oldest))
+                oldest = texture;
+        }
+        if (!oldest) {
+            if (!over_budget)
+                fprintf(stderr, ERROR("texture budget exceeded: %lldkb in use, nothing to evict\n"),
+                    total_bytes / 1024);
+            over_budget = 1;
+            return;
+        }
+        unlink_texture(oldest);
+        oldest->evict(oldest);
+    }
+}
+
+void texture_init(texture_t *texture, texture_type type) {
+    texture->owner = current_owner;
+    texture->type = type;
+    texture->bytes = 0;
+    texture->last_drawn = frame;
+    texture->evict = NULL;
+    texture->prev = texture->next = NULL;
+}
+
+// Accounts a newly allocated texture
+void texture_add(texture_t *texture, long long bytes) {
+    pthread_mutex_lock(&lock);
+    texture->bytes = bytes;
+    texture->last_drawn = frame;
+    if (texture->owner)
+        texture->owner->bytes[texture->type] += bytes;
+    type_bytes[texture->type] += bytes;
+    total_bytes += bytes;
+    if (texture->evict)
+        DL_APPEND(evictable, texture);
+    enforce_budget();
+    pthread_mutex_unlock(&lock);
+}
+
+// The texture was deleted
+void texture_remove(texture_t *texture) {
+    pthread_mutex_lock(&lock);
+    unlink_texture(texture);
+    pthread_mutex_unlock(&lock);
+}
+
+void texture_drawn(texture_t *texture) {
+    texture->last_drawn = frame;
+}
+
+// Memory not owned by any node
+void texture_account(texture_type type, long long bytes) {
+    pthread_mutex_lock(&lock);
+    type_bytes[type] += bytes;
+    total_bytes += bytes;
+    pthread_mutex_unlock(&lock);
+}
+
+long long texture_owner_bytes(texture_owner_t *owner) {
+    long long bytes = 0;
+    for (int type = 0; type < TEXTURE_NUM_TYPES; type++)
+        bytes += owner->bytes[type];
+    return bytes;
+}
+
+long long texture_type_bytes(texture_type type) {
+    return type_bytes[type];
+}
+
+long long texture_total_bytes() {
+    return total_bytes;
+}
+
+const char *texture_type_name(texture_type type) {
+    return type_names[type];
+}
+
+// Frames counted so far. Used for draw recency.
+int texture_frame() {
+    return frame;
+}
+
+void texture_next_frame() {
+    pthread_mutex_lock(&lock);
+    frame++;
+    enforce_budget();
+    pthread_mutex_unlock(&lock);
+}
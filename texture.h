@@ -0,0 +1,51 @@
+/* See Copyright Notice in LICENSE.txt */
+
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+typedef enum {
+    TEXTURE_IMAGE,      // images and colored textures
+    TEXTURE_SNAPSHOT,
+    TEXTURE_FBO,        // rendered nodes and the framebuffer recycler
+    TEXTURE_VIDEO,
+    TEXTURE_VNC,
+    TEXTURE_NUM_TYPES,
+} texture_type;
+
+// Texture memory of a single node
+typedef struct {
+    long long bytes[TEXTURE_NUM_TYPES];
+    int last_drawn; // frame number
+} texture_owner_t;
+
+// A texture in the registry, embedded in the resource using it
+typedef struct texture_s {
+    texture_owner_t *owner;
+    texture_type type;
+    long long bytes;    // 0 while not allocated
+    int last_drawn;
+
+    // Releases the texture once the registry dropped it. The resource
+    // loads it again when drawn. NULL if it cannot be restored.
+    void (*evict)(struct texture_s *texture);
+
+    struct texture_s *prev, *next;
+} texture_t;
+
+long long texture_size(int width, int height, int mipmap);
+void texture_set_budget(long long budget);
+texture_owner_t *texture_swap_owner(texture_owner_t *owner);
+void texture_owner_drawn(texture_owner_t *owner);
+void texture_init(texture_t *texture, texture_type type);
+void texture_add(texture_t *texture, long long bytes);
+void texture_remove(texture_t *texture);
+void texture_drawn(texture_t *texture);
+void texture_account(texture_type type, long long bytes);
+long long texture_owner_bytes(texture_owner_t *owner);
+long long texture_type_bytes(texture_type type);
+long long texture_total_bytes();
+const char *texture_type_name(texture_type type);
+void texture_next_frame();
+int texture_frame();
+
+#endif
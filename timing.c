@@ -0,0 +1,103 @@
+/* See Copyright Notice in LICENSE.txt */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <time.h>
+
+#include "timing.h"
+
+// How much of the observed difference between the predicted
+// and the actual vsync is applied per frame. Small values keep
+// swap return jitter out of the reported time.
+#define PHASE_GAIN 0.1
+
+static int mode = TIMING_REAL;
+static double period;       // fixed step or time between displayed frames
+static double start;
+static int frames = 0;      // number of completed frames
+
+static double vsync = -1;   // estimated time of the last displayed vsync
+static double display;      // predicted display time of the current frame
+static double frame_end;    // time the last frame ended
+
+static double monotonic() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+void timing_init(int clock_mode, double frame_period) {
+    mode = clock_mode;
+    period = frame_period;
+    start = monotonic();
+}
+
+int timing_mode() {
+    return mode;
+}
+
+double timing_period() {
+    return period;
+}
+
+double timing_real() {
+    return monotonic() - start;
+}
+
+double timing_frame_start() {
+    double t = timing_real();
+    switch (mode) {
+        case TIMING_FIXED:
+            return frames * period;
+        case TIMING_PACED:
+            if (vsync < 0)
+                vsync = t;
+            // The frame will be visible at the vsync following
+            // the last one. If we're already past that (after a
+            // slow frame), skip to the next vsync still reachable.
+            display = vsync + period;
+            while (display < t)
+                display += period;
+            return display;
+        default:
+            return t;
+    }
+}
+
+void timing_frame_end() {
+    frames++;
+    frame_end = timing_real();
+    if (mode != TIMING_PACED)
+        return;
+
+    double t = frame_end;
+
+    // Swapping didn't block (no vsync, headless or swap
+    // interval 0): Wait for the target time ourselves.
+    double ahead = display - t;
+    if (ahead > period / 4) {
+        struct timespec ts = {
+            .tv_sec = (time_t)ahead,
+            .tv_nsec = (long)((ahead - (time_t)ahead) * 1000000000.0),
+        };
+        nanosleep(&ts, NULL);
+        t = display;
+    }
+
+    // Swap returned late: the frame was displayed one
+    // or more vsyncs after the predicted one.
+    while (t > display + period / 2)
+        display += period;
+
+    // Slowly follow the real vsync phase. The error is
+    // within [-period/2, period/2] at this point.
+    vsync = display + (t - display) * PHASE_GAIN;
+}
+
+// Estimated time of the next vsync after a frame ended. Without
+// the paced clock, swapping is assumed to return right after a vsync.
+double timing_next_vsync() {
+    if (mode == TIMING_PACED)
+        return vsync + period;
+    return frame_end + period;
+}
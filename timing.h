@@ -0,0 +1,18 @@
+/* See Copyright Notice in LICENSE.txt */
+
+#ifndef TIMING_H
+#define TIMING_H
+
+#define TIMING_REAL  0 // wall clock time at frame start
+#define TIMING_FIXED 1 // fixed step per frame
+#define TIMING_PACED 2 // predicted display time of the frame
+
+void timing_init(int mode, double frame_period);
+int timing_mode();
+double timing_period();
+double timing_real();
+double timing_frame_start();
+void timing_frame_end();
+double timing_next_vsync();
+
+#endif
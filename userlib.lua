@@ -9,17 +9,20 @@ end
 function util.videoplayer(name, opt)
     local stream, start, fps, frame, width, height
 
-    local function open_stream()
-        stream = resource.load_video(name)
-        start = sys.now()
+    opt = opt or {}
+
+    -- With opt.start, frame 0 is shown at that sys.now() time. All
+    -- instances synced with INFOBEAMER_SYNC then show the same frame.
+    local function open_stream(start_time)
+        stream = resource.load_video(name, opt.shared)
+        start = start_time
         fps = stream:fps()
         frame = 0
         width, height = stream:size()
     end
 
-    open_stream()
+    open_stream(opt.start or sys.now())
 
-    opt = opt or {}
     local speed = opt.speed or 1
     fps = fps * speed
 
@@ -29,10 +32,14 @@ function util.videoplayer(name, opt)
     local done = false
 
     return {
-        draw = function(self, x1, y1, x2, y2, alpha)
+        draw = function(self, x1, y1, x2, y2, alpha, sx1, sy1, sx2, sy2)
             if done then return end
             local now = sys.now()
             local target_frame = (now - start) * fps
+            if opt.start then
+                -- synced: never rebase, catch up a few frames per call
+                target_frame = math.min(target_frame, frame + 10)
+            end
             if target_frame > frame + 10 then
                 print(string.format(
                     "slow player for '%s'. missed %d frames since last call",
@@ -46,7 +53,11 @@ function util.videoplayer(name, opt)
                     if not stream:next() then
                         if loop then
                             print("player: looping")
-                            open_stream()
+                            if opt.start then
+                                open_stream(start + frame / fps)
+                            else
+                                open_stream(sys.now())
+                            end
                             stream:next()
                             break
                         else
@@ -58,7 +69,7 @@ function util.videoplayer(name, opt)
                     frame = frame + 1
                 end
             end
-            stream:draw(x1, y1, x2, y2, alpha)
+            stream:draw(x1, y1, x2, y2, alpha, sx1, sy1, sx2, sy2)
             return true
         end;
         texid = function(self)
@@ -487,6 +498,21 @@ package = {
             end
         end;
 
+        -- native modules loader
+        function(modname)
+            local module = _NATIVE_MODULES[modname]
+            if not module then
+                return "no native module " .. modname
+            else
+                return function(loader_modname)
+                    assert(loader_modname == modname)
+                    -- module() in the lua version sets a global
+                    _G[modname] = module
+                    return module
+                end, modname
+            end
+        end;
+
         -- bundled moduls loader
         function(modname)
             local filename = modname .. ".lua"
@@ -24,9 +24,13 @@
  * License along with ffmpeg_test. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include <GL/glew.h>
 #include <GL/gl.h>
@@ -36,10 +40,18 @@
 #include <libavformat/avformat.h>
 #include <libswscale/swscale.h>
 
+#include "utlist.h"
 #include "misc.h"
 #include "shader.h"
-
-typedef struct {
+#include "stats.h"
+#include "worker.h"
+#include "fastpath.h"
+#include "texture.h"
+#include "release.h"
+#include "cull.h"
+
+// A decoder and the texture it uploads to
+typedef struct decoder_s {
     AVFormatContext *format_context;
     AVCodecContext *codec_context;
     AVCodec *codec;
@@ -52,163 +64,190 @@ typedef struct {
     int buffer_width, buffer_height;
     double par;
     GLuint tex;
+    texture_t texture;
     double fps;
     int finished;
+
+    int frame;      // number of decoded frames
+    int refs;       // video objects using this decoder
+    int shared;     // can be used by other video objects
+    dev_t dev;      // file of a shared decoder
+    ino_t ino;
+    struct decoder_s *prev, *next;
+} decoder_t;
+
+// A video object. Videos loaded with the shared flag use
+// the same decoder if they are loaded from the same file.
+typedef struct {
+    decoder_t *dec;
+    int frame;      // number of frames this video advanced
 } video_t;
 
+// Shared decoders. Finalizers on worker threads unref
+// decoders, so the list and refs are protected by a lock.
+static decoder_t *shared_decoders = NULL;
+static pthread_mutex_t decoders_lock = PTHREAD_MUTEX_INITIALIZER;
+
 LUA_TYPE_DECL(video)
 
 /* Helper functions */
 
-static void video_free(video_t *video) {
-    if (video->scaler)
-        sws_freeContext(video->scaler);
-    if (video->raw_frame)
-        av_free(video->raw_frame);
-    if (video->scaled_frame)
-        av_free(video->scaled_frame);
-
-    if (video->codec_context)
-        avcodec_close(video->codec_context);
-    if (video->format_context)
-        avformat_close_input(&video->format_context);
-
-    av_free(video->buffer);
+static void decoder_free(decoder_t *dec) {
+    if (dec->scaler)
+        sws_freeContext(dec->scaler);
+    if (dec->raw_frame)
+        av_free(dec->raw_frame);
+    if (dec->scaled_frame)
+        av_free(dec->scaled_frame);
+
+    if (dec->codec_context)
+        avcodec_close(dec->codec_context);
+    if (dec->format_context)
+        avformat_close_input(&dec->format_context);
+
+    av_free(dec->buffer);
+
+    dec->scaler = NULL;
+    dec->raw_frame = NULL;
+    dec->scaled_frame = NULL;
+    dec->codec_context = NULL;
+    dec->format_context = NULL;
+    dec->buffer = NULL;
 }
 
-static int video_open(video_t *video, const char *filename) {
-    video->finished = 0;
-    video->format = PIX_FMT_RGB24;
+static int decoder_open(decoder_t *dec, const char *filename) {
+    dec->finished = 0;
+    dec->format = PIX_FMT_RGB24;
 
-    if (avformat_open_input(&video->format_context, filename, NULL, NULL) ||
-            avformat_find_stream_info(video->format_context, NULL) < 0) {
+    if (avformat_open_input(&dec->format_context, filename, NULL, NULL) ||
+            avformat_find_stream_info(dec->format_context, NULL) < 0) {
         fprintf(stderr, ERROR("cannot open video stream %s\n"), filename);
         goto failed;
     }
 
-    video->stream_idx = -1;
-    for (int i = 0; i < video->format_context->nb_streams; i++) {
-        if (video->format_context->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
-            video->stream_idx = i;
+    dec->stream_idx = -1;
+    for (int i = 0; i < dec->format_context->nb_streams; i++) {
+        if (dec->format_context->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
+            dec->stream_idx = i;
             break;
         }
     }
 
-    if (video->stream_idx == -1) {
+    if (dec->stream_idx == -1) {
         fprintf(stderr, ERROR("cannot find video stream\n"));
         goto failed;
     }
 
-    AVStream *stream = video->format_context->streams[video->stream_idx];
-    video->codec_context = stream->codec;
-    video->codec = avcodec_find_decoder(video->codec_context->codec_id);
+    AVStream *stream = dec->format_context->streams[dec->stream_idx];
+    dec->codec_context = stream->codec;
+    dec->codec = avcodec_find_decoder(dec->codec_context->codec_id);
 
     /* Save Width/Height */
-    video->width = video->codec_context->width;
-    video->height = video->codec_context->height;
+    dec->width = dec->codec_context->width;
+    dec->height = dec->codec_context->height;
 
-    if (!video->codec || avcodec_open2(video->codec_context, video->codec, NULL) < 0) {
+    if (!dec->codec || avcodec_open2(dec->codec_context, dec->codec, NULL) < 0) {
         fprintf(stderr, ERROR("cannot open codec\n"));
         goto failed;
     }
 
-    video->buffer_width = video->codec_context->width;
-    video->buffer_height = video->codec_context->height;
+    dec->buffer_width = dec->codec_context->width;
+    dec->buffer_height = dec->codec_context->height;
 
     fprintf(stderr, INFO("pixel aspect ratio: %d/%d, size: %dx%d buffer size: %dx%d\n"), 
-        video->codec_context->sample_aspect_ratio.num,
-        video->codec_context->sample_aspect_ratio.den,
-        video->width,
-        video->height,
-        video->buffer_width,
-        video->buffer_height
+        dec->codec_context->sample_aspect_ratio.num,
+        dec->codec_context->sample_aspect_ratio.den,
+        dec->width,
+        dec->height,
+        dec->buffer_width,
+        dec->buffer_height
     );
 
-    video->par = (float)video->codec_context->sample_aspect_ratio.num / video->codec_context->sample_aspect_ratio.den;
-    if (video->par == 0)
-        video->par = 1;
+    dec->par = (float)dec->codec_context->sample_aspect_ratio.num / dec->codec_context->sample_aspect_ratio.den;
+    if (dec->par == 0)
+        dec->par = 1;
 
     /* Frame rate fix for some codecs */
-    if (video->codec_context->time_base.num > 1000 && video->codec_context->time_base.den == 1)
-        video->codec_context->time_base.den = 1000;
+    if (dec->codec_context->time_base.num > 1000 && dec->codec_context->time_base.den == 1)
+        dec->codec_context->time_base.den = 1000;
 
     /* Get FPS */
     // http://libav-users.943685.n4.nabble.com/Retrieving-Frames-Per-Second-FPS-td946533.html
     if ((stream->time_base.den != stream->avg_frame_rate.num) ||
             (stream->time_base.num != stream->avg_frame_rate.den)) {
-        video->fps = 1.0 / stream->avg_frame_rate.den * stream->avg_frame_rate.num;
+        dec->fps = 1.0 / stream->avg_frame_rate.den * stream->avg_frame_rate.num;
     } else {
-        video->fps = 1.0 / stream->time_base.num * stream->time_base.den;
+        dec->fps = 1.0 / stream->time_base.num * stream->time_base.den;
     }
-    fprintf(stderr, INFO("fps: %lf\n"), video->fps);
+    fprintf(stderr, INFO("fps: %lf\n"), dec->fps);
 
     /* Get framebuffers */
-    video->raw_frame = avcodec_alloc_frame();
-    video->scaled_frame = avcodec_alloc_frame();
+    dec->raw_frame = avcodec_alloc_frame();
+    dec->scaled_frame = avcodec_alloc_frame();
 
-    if (!video->raw_frame || !video->scaled_frame) {
+    if (!dec->raw_frame || !dec->scaled_frame) {
         fprintf(stderr, ERROR("cannot preallocate frames\n"));
         goto failed;
     }
 
     /* Create data buffer */
-    video->buffer = av_malloc(avpicture_get_size(
-        video->format, 
-        video->buffer_width, 
-        video->buffer_height
+    dec->buffer = av_malloc(avpicture_get_size(
+        dec->format, 
+        dec->buffer_width, 
+        dec->buffer_height
     ));
 
     /* Init buffers */
     avpicture_fill(
-        (AVPicture *) video->scaled_frame, 
-        video->buffer, 
-        video->format, 
-        video->buffer_width, 
-        video->buffer_height
+        (AVPicture *) dec->scaled_frame, 
+        dec->buffer, 
+        dec->format, 
+        dec->buffer_width, 
+        dec->buffer_height
     );
 
     /* Init scale & convert */
-    video->scaler = sws_getContext(
-        video->buffer_width,
-        video->buffer_height,
-        video->codec_context->pix_fmt,
-        video->buffer_width, 
-        video->buffer_height, 
-        video->format, 
+    dec->scaler = sws_getContext(
+        dec->buffer_width,
+        dec->buffer_height,
+        dec->codec_context->pix_fmt,
+        dec->buffer_width, 
+        dec->buffer_height, 
+        dec->format, 
         SWS_BICUBIC, 
         NULL, 
         NULL, 
         NULL
     );
 
-    if (!video->scaler) {
+    if (!dec->scaler) {
         fprintf(stderr, ERROR("scale context init failed\n"));
         goto failed;
     }
 
     /* Give some info on stderr about the file & stream */
-    av_dump_format(video->format_context, 0, filename, 0);
+    av_dump_format(dec->format_context, 0, filename, 0);
     return 1;
 failed:
-    video_free(video);
+    decoder_free(dec);
     return 0;
 }
 
-static int video_next_frame(video_t *video) {
+static int decoder_next_frame(decoder_t *dec) {
     AVPacket packet;
     av_init_packet(&packet);
 
 again:
     /* Can we read a frame? */
-    if (av_read_frame(video->format_context, &packet)) {
+    if (av_read_frame(dec->format_context, &packet)) {
         fprintf(stderr, "no next frame\n");
-        video->finished = 1;
+        dec->finished = 1;
         av_free_packet(&packet);
         return 0;
     }
 
     /* Is it what we're trying to parse? */
-    if (packet.stream_index != video->stream_idx) {
+    if (packet.stream_index != dec->stream_idx) {
         // fprintf(stderr, "not video\n");
         av_free_packet(&packet);
         goto again;
@@ -216,7 +255,7 @@ again:
 
     /* Decode it! */
     int complete_frame = 0;
-    avcodec_decode_video2(video->codec_context, video->raw_frame, &complete_frame, &packet);
+    avcodec_decode_video2(dec->codec_context, dec->raw_frame, &complete_frame, &packet);
 
     /* Success? If not, drop packet. */
     if (!complete_frame) {
@@ -230,62 +269,111 @@ again:
      */
 
     int heights[] = {
-        video->buffer_height     - 1,
-        video->buffer_height / 2 - 1,
-        video->buffer_height / 2 - 1,
+        dec->buffer_height     - 1,
+        dec->buffer_height / 2 - 1,
+        dec->buffer_height / 2 - 1,
         0,
     };
 
     for (int i = 0; i < 4; i++) { 
-        video->raw_frame->data[i] += video->raw_frame->linesize[i] * heights[i];
-        video->raw_frame->linesize[i] = -video->raw_frame->linesize[i]; 
-        // fprintf(stderr, "%d -> %d\n", video->raw_frame->linesize[i], video->scaled_frame->linesize[i]);
+        dec->raw_frame->data[i] += dec->raw_frame->linesize[i] * heights[i];
+        dec->raw_frame->linesize[i] = -dec->raw_frame->linesize[i]; 
+        // fprintf(stderr, "%d -> %d\n", dec->raw_frame->linesize[i], dec->scaled_frame->linesize[i]);
     } 
 
     sws_scale(
-        video->scaler, 
-        (const uint8_t* const *)video->raw_frame->data, 
-        video->raw_frame->linesize, 
+        dec->scaler, 
+        (const uint8_t* const *)dec->raw_frame->data, 
+        dec->raw_frame->linesize, 
         0, 
-        video->buffer_height, 
-        video->scaled_frame->data, 
-        video->scaled_frame->linesize
+        dec->buffer_height, 
+        dec->scaled_frame->data, 
+        dec->scaled_frame->linesize
     );
     av_free_packet(&packet);
     return 1;
 }
 
+// Deletes the texture and frees the decoder on the render thread
+static void decoder_destroy(void *ptr) {
+    decoder_t *dec = ptr;
+    glDeleteTextures(1, &dec->tex);
+    stats_texture(dec->width, dec->height, 0);
+    decoder_free(dec);
+    free(dec);
+}
+
+static void decoder_unref(decoder_t *dec) {
+    pthread_mutex_lock(&decoders_lock);
+    int unused = --dec->refs == 0;
+    if (unused && dec->shared)
+        DL_DELETE(shared_decoders, dec);
+    pthread_mutex_unlock(&decoders_lock);
+    if (!unused)
+        return;
+    // the owning node might be gone once the release runs
+    texture_remove(&dec->texture);
+    release_call(decoder_destroy, dec);
+}
+
+// Frees the decoder once no other video uses it. Called by
+// dispose and again by gc.
+static void video_release(video_t *video) {
+    if (!video->dec)
+        return;
+    decoder_unref(video->dec);
+    video->dec = NULL;
+}
+
+static decoder_t *checked_decoder(lua_State *L, int idx) {
+    video_t *video = checked_video(L, idx);
+    if (!video->dec)
+        fastpath_error(L, FASTPATH_DISPOSED);
+    return video->dec;
+}
+
 /* Instance methods */
 
 static int video_size(lua_State *L) {
-    video_t *video = checked_video(L, 1);
-    lua_pushnumber(L, video->width);
-    lua_pushnumber(L, video->height / video->par);
+    decoder_t *dec = checked_decoder(L, 1);
+    lua_pushnumber(L, dec->width);
+    lua_pushnumber(L, dec->height / dec->par);
     return 2;
 }
 
 static int video_fps(lua_State *L) {
-    video_t *video = checked_video(L, 1);
-    lua_pushnumber(L, video->fps);
+    decoder_t *dec = checked_decoder(L, 1);
+    lua_pushnumber(L, dec->fps);
     return 1;
 }
 
 static int video_next(lua_State *L) {
+    require_render_thread(L);
     video_t *video = checked_video(L, 1);
+    decoder_t *dec = checked_decoder(L, 1);
 
-    if (!video_next_frame(video)) {
+    // Another video using this decoder is ahead. Catch up one
+    // frame per call, so each video still sees every frame.
+    if (video->frame < dec->frame) {
+        video->frame++;
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+
+    if (!decoder_next_frame(dec)) {
         lua_pushboolean(L, 0);
         return 1;
     }
+    video->frame = ++dec->frame;
 
-    glBindTexture(GL_TEXTURE_2D, video->tex);
+    glBindTexture(GL_TEXTURE_2D, dec->tex);
 
     glPushClientAttrib(GL_CLIENT_PIXEL_STORE_BIT);
     glPixelStorei(GL_UNPACK_SWAP_BYTES, GL_TRUE);
     glPixelStorei(GL_UNPACK_LSB_FIRST,  GL_TRUE);
     glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
-    glPixelStorei(GL_UNPACK_SKIP_ROWS, video->buffer_height - video->height);
-    glPixelStorei(GL_UNPACK_ROW_LENGTH, video->buffer_width);
+    glPixelStorei(GL_UNPACK_SKIP_ROWS, dec->buffer_height - dec->height);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, dec->buffer_width);
     glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
 
     glTexSubImage2D(
@@ -293,11 +381,11 @@ static int video_next(lua_State *L) {
         0,
         0,
         0,
-        video->width,
-        video->height,
+        dec->width,
+        dec->height,
         GL_RGB,
         GL_UNSIGNED_BYTE,
-        video->buffer 
+        dec->buffer 
     );
     glGenerateMipmap(GL_TEXTURE_2D);
     glPopClientAttrib();
@@ -308,13 +396,42 @@ static int video_next(lua_State *L) {
 
 static int video_state(lua_State *L) {
     video_t *video = checked_video(L, 1);
-    lua_pushstring(L, video->finished ? "finished" : "loaded");
-    lua_pushnumber(L, video->width);
-    lua_pushnumber(L, video->height / video->par);
-    lua_pushnumber(L, video->fps);
+    decoder_t *dec = video->dec;
+    if (!dec) {
+        lua_pushliteral(L, "disposed");
+        return 1;
+    }
+    lua_pushstring(L, dec->finished ? "finished" : "loaded");
+    lua_pushnumber(L, dec->width);
+    lua_pushnumber(L, dec->height / dec->par);
+    lua_pushnumber(L, dec->fps);
     return 4;
 }
 
+int fastpath_video_draw(void *obj, double x1, double y1, double x2, double y2,
+        double alpha, double sx1, double sy1, double sx2, double sy2)
+{
+    if (!worker_on_render_thread())
+        return FASTPATH_NOT_RENDER_THREAD;
+    video_t *video = obj;
+    if (!video->dec)
+        return FASTPATH_DISPOSED;
+    if (cull_skip(x1, y1, x2, y2))
+        return FASTPATH_OK;
+
+    glBindTexture(GL_TEXTURE_2D, video->dec->tex);
+    shader_set_gl_color(1.0, 1.0, 1.0, alpha);
+
+    // The decoded frames are upside down
+    glBegin(GL_QUADS); 
+        glTexCoord2f(sx1, 1.0 - sy1); glVertex3f(x1, y1, 0);
+        glTexCoord2f(sx2, 1.0 - sy1); glVertex3f(x2, y1, 0);
+        glTexCoord2f(sx2, 1.0 - sy2); glVertex3f(x2, y2, 0);
+        glTexCoord2f(sx1, 1.0 - sy2); glVertex3f(x1, y2, 0);
+    glEnd();
+    return FASTPATH_OK;
+}
+
 static int video_draw(lua_State *L) {
     video_t *video = checked_video(L, 1);
     GLfloat x1 = luaL_checknumber(L, 2);
@@ -322,26 +439,24 @@ static int video_draw(lua_State *L) {
     GLfloat x2 = luaL_checknumber(L, 4);
     GLfloat y2 = luaL_checknumber(L, 5);
     GLfloat alpha = luaL_optnumber(L, 6, 1.0);
-
-    glBindTexture(GL_TEXTURE_2D, video->tex);
-    shader_set_gl_color(1.0, 1.0, 1.0, alpha);
-
-    glBegin(GL_QUADS); 
-        glTexCoord2f(0.0, 1.0); glVertex3f(x1, y1, 0);
-        glTexCoord2f(1.0, 1.0); glVertex3f(x2, y1, 0);
-        glTexCoord2f(1.0, 0.0); glVertex3f(x2, y2, 0);
-        glTexCoord2f(0.0, 0.0); glVertex3f(x1, y2, 0);
-    glEnd();
+    GLfloat sx1 = luaL_optnumber(L, 7, 0);
+    GLfloat sy1 = luaL_optnumber(L, 8, 0);
+    GLfloat sx2 = luaL_optnumber(L, 9, 1);
+    GLfloat sy2 = luaL_optnumber(L, 10, 1);
+    int ret = fastpath_video_draw(video, x1, y1, x2, y2, alpha, sx1, sy1, sx2, sy2);
+    if (ret != FASTPATH_OK)
+        return fastpath_error(L, ret);
     return 0;
 }
 
 static int video_texid(lua_State *L) {
     video_t *video = checked_video(L, 1);
-    lua_pushnumber(L, video->tex);
+    lua_pushnumber(L, video->dec ? video->dec->tex : 0);
     return 1;
 }
 
 static int video_dispose(lua_State *L) {
+    video_release(checked_video(L, 1));
     return 0;
 }
 
@@ -358,15 +473,46 @@ static const luaL_reg video_methods[] = {
 
 /* Lifecycle */
 
-int video_load(lua_State *L, const char *path, const char *name) {
-    video_t video;
-    memset(&video, 0, sizeof(video_t));
+// A shared decoder of the same file that is still running
+static decoder_t *find_shared_decoder(struct stat *st) {
+    decoder_t *dec;
+    DL_FOREACH(shared_decoders, dec) {
+        if (dec->dev == st->st_dev && dec->ino == st->st_ino && !dec->finished)
+            return dec;
+    }
+    return NULL;
+}
 
-    if (!video_open(&video, path))
+int video_load(lua_State *L, const char *path, const char *name, int shared) {
+    struct stat st;
+    if (stat(path, &st) == -1)
         return luaL_error(L, "cannot open video %s", path);
 
-    glGenTextures(1, &video.tex);
-    glBindTexture(GL_TEXTURE_2D, video.tex);
+    video_t *video = push_video(L);
+    video->dec = NULL;
+    video->frame = 0;
+
+    if (shared) {
+        pthread_mutex_lock(&decoders_lock);
+        decoder_t *dec = find_shared_decoder(&st);
+        if (dec)
+            dec->refs++;
+        pthread_mutex_unlock(&decoders_lock);
+        if (dec) {
+            video->dec = dec;
+            video->frame = dec->frame;
+            return 1;
+        }
+    }
+
+    decoder_t *dec = xmalloc(sizeof(decoder_t));
+    if (!decoder_open(dec, path)) {
+        free(dec);
+        return luaL_error(L, "cannot open video %s", path);
+    }
+
+    glGenTextures(1, &dec->tex);
+    glBindTexture(GL_TEXTURE_2D, dec->tex);
 
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR_MIPMAP_LINEAR);
@@ -376,23 +522,41 @@ int video_load(lua_State *L, const char *path, const char *name) {
         GL_TEXTURE_2D,  
         0,
         GL_RGB, 
-        video.width,
-        video.height,
+        dec->width,
+        dec->height,
         0,
         GL_RGB,
         GL_UNSIGNED_BYTE,
         NULL 
     );
+    stats_texture(dec->width, dec->height, 1);
+
+    texture_init(&dec->texture, TEXTURE_VIDEO);
+    if (shared) {
+        // outlives the node that loaded it
+        dec->texture.owner = NULL;
+    }
+    texture_add(&dec->texture, texture_size(dec->width, dec->height, 1));
+
+    dec->refs = 1;
+    dec->shared = shared;
+    dec->dev = st.st_dev;
+    dec->ino = st.st_ino;
+    if (shared) {
+        pthread_mutex_lock(&decoders_lock);
+        DL_APPEND(shared_decoders, dec);
+        pthread_mutex_unlock(&decoders_lock);
+    }
 
-    *push_video(L) = video;
+    video->dec = dec;
     return 1;
 }
 
 static int video_gc(lua_State *L) {
     video_t *video = to_video(L, 1);
-    fprintf(stderr, INFO("gc'ing video: tex id: %d\n"), video->tex);
-    glDeleteTextures(1, &video->tex);
-    video_free(video);
+    if (video->dec)
+        fprintf(stderr, INFO("gc'ing video: tex id: %d\n"), video->dec->tex);
+    video_release(video);
     return 0;
 }
 
@@ -4,6 +4,6 @@
 #define VIDEO_H
 
 int video_register(lua_State *L);
-int video_load(lua_State *L, const char *path, const char *name);
+int video_load(lua_State *L, const char *path, const char *name, int shared);
 
 #endif
@@ -20,6 +20,11 @@
 
 #include "misc.h"
 #include "shader.h"
+#include "stats.h"
+#include "worker.h"
+#include "texture.h"
+#include "release.h"
+#include "cull.h"
 
 typedef struct vnc_s vnc_t;
 typedef void(*protocol_handler)(vnc_t *);
@@ -40,6 +45,7 @@ typedef struct {
 
 struct vnc_s {
     GLuint tex;
+    texture_t texture;
     int width;
     int height;
     struct bufferevent *buf_ev;
@@ -47,6 +53,7 @@ struct vnc_s {
     char *host;
     int port;
     int alive;
+    int disposed;
 
     protocol_handler handler;
     int num_bytes;
@@ -73,12 +80,17 @@ static int vnc_size(lua_State *L) {
 }
 
 static int vnc_draw(lua_State *L) {
+    require_render_thread(L);
     vnc_t *vnc = checked_vnc(L, 1);
+    if (vnc->disposed)
+        return luaL_error(L, "resource disposed");
     GLfloat x1 = luaL_checknumber(L, 2);
     GLfloat y1 = luaL_checknumber(L, 3);
     GLfloat x2 = luaL_checknumber(L, 4);
     GLfloat y2 = luaL_checknumber(L, 5);
     GLfloat alpha = luaL_optnumber(L, 6, 1.0);
+    if (cull_skip(x1, y1, x2, y2))
+        return 0;
 
     glBindTexture(GL_TEXTURE_2D, vnc->tex);
     shader_set_gl_color(1.0, 1.0, 1.0, alpha);
@@ -105,11 +117,23 @@ static int vnc_texid(lua_State *L) {
     return 1;
 }
 
+static void vnc_close(vnc_t *vnc);
+
+// Closes the connection and frees the texture
+static int vnc_dispose(lua_State *L) {
+    require_render_thread(L);
+    vnc_t *vnc = checked_vnc(L, 1);
+    vnc_close(vnc);
+    vnc->disposed = 1;
+    return 0;
+}
+
 static const luaL_reg vnc_methods[] = {
     {"draw",    vnc_draw},
     {"size",    vnc_size},
     {"alive",   vnc_alive},
     {"texid",   vnc_texid},
+    {"dispose", vnc_dispose},
     {0,0}
 };
 
@@ -138,7 +162,8 @@ static void vnc_close(vnc_t *vnc) {
         vnc->buf_ev = NULL;
     }
     if (vnc->tex) {
-        glDeleteTextures(1, &vnc->tex);
+        release_texture(vnc->tex, vnc->width, vnc->height, 0);
+        texture_remove(&vnc->texture);
         vnc->tex = 0;
     }
     vnc->alive = 0;
@@ -432,6 +457,8 @@ static void vnc_read_server_init(vnc_t *vnc) {
         GL_UNSIGNED_BYTE,
         NULL
     );
+    stats_texture(vnc->width, vnc->height, 1);
+    texture_add(&vnc->texture, texture_size(vnc->width, vnc->height, 1));
     
     vnc_printf(vnc, "got screen: %dx%d\n", vnc->width, vnc->height);
     return vnc_set_handler(vnc, vnc_read_server_name, name_len);
@@ -471,10 +498,12 @@ static void vnc_read_handshake(vnc_t *vnc) {
 int vnc_create(lua_State *L, const char *host, int port) {
     vnc_t *vnc = push_vnc(L);
     vnc->tex = 0;
+    texture_init(&vnc->texture, TEXTURE_VNC);
     vnc->width = 0;
     vnc->height = 0;
     vnc->buf_ev = NULL;
     vnc->alive = 1;
+    vnc->disposed = 0;
 
     vnc->host = strdup(host);
     vnc->port = port;
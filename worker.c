@@ -0,0 +1,99 @@
+/* See Copyright Notice in LICENSE.txt */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "misc.h"
+#include "worker.h"
+
+static pthread_t render_thread;
+static pthread_t *threads = NULL;
+static int num_threads = 0;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_available = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t work_done = PTHREAD_COND_INITIALIZER;
+
+// current batch, protected by lock
+static void **batch_items;
+static int batch_size;
+static int batch_next;
+static int batch_completed;
+static worker_func batch_func;
+
+static void *worker_main(void *arg) {
+    pthread_mutex_lock(&lock);
+    while (1) {
+        while (batch_next >= batch_size)
+            pthread_cond_wait(&work_available, &lock);
+
+        void *item = batch_items[batch_next++];
+        worker_func func = batch_func;
+        pthread_mutex_unlock(&lock);
+
+        func(item);
+
+        pthread_mutex_lock(&lock);
+        if (++batch_completed == batch_size)
+            pthread_cond_signal(&work_done);
+    }
+    return NULL;
+}
+
+void worker_init(int num_workers) {
+    render_thread = pthread_self();
+    if (num_workers <= 0)
+        return;
+
+    // Workers must never receive signals: the SIGVTALRM
+    // based deadline handling only works for the render thread.
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    threads = xmalloc(sizeof(pthread_t) * num_workers);
+    for (int i = 0; i < num_workers; i++) {
+        if (pthread_create(&threads[i], NULL, worker_main, NULL))
+            die("cannot start worker thread");
+    }
+    num_threads = num_workers;
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    fprintf(stderr, INFO("started %d worker threads\n"), num_workers);
+}
+
+int worker_count() {
+    return num_threads;
+}
+
+int worker_on_render_thread() {
+    return pthread_equal(pthread_self(), render_thread);
+}
+
+void worker_run(void **items, int num_items, worker_func func) {
+    if (num_threads == 0) {
+        for (int i = 0; i < num_items; i++)
+            func(items[i]);
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    batch_items = items;
+    batch_size = num_items;
+    batch_next = 0;
+    batch_completed = 0;
+    batch_func = func;
+    pthread_cond_broadcast(&work_available);
+
+    while (batch_completed < batch_size)
+        pthread_cond_wait(&work_done, &lock);
+
+    batch_items = NULL;
+    batch_size = 0;
+    batch_next = 0;
+    pthread_mutex_unlock(&lock);
+}
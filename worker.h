@@ -0,0 +1,19 @@
+/* See Copyright Notice in LICENSE.txt */
+
+#ifndef WORKER_H
+#define WORKER_H
+
+typedef void (*worker_func)(void *item);
+
+void worker_init(int num_workers);
+int worker_count();
+int worker_on_render_thread();
+void worker_run(void **items, int num_items, worker_func func);
+
+#define require_render_thread(L) \
+    do { \
+        if (!worker_on_render_thread()) \
+            luaL_error(L, "only callable on the render thread"); \
+    } while (0)
+
+#endif